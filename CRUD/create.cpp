@@ -6,10 +6,19 @@
 #include "crud.h"
 #include "../main.h"
 #include "../database.h"
+#include "../scheduler.h"
 
 void CRUD::create(nlohmann::json& documents, nlohmann::json& response)
 {
+	// When the answer is sent (see WriteConcern)
+	WriteConcern concern;
+	if (!readWriteConcern(documents, concern)) {
+		response = { {"status", "failed"}, {"error", {"InvalidWriteConcern", "writeConcern has to be none, buffered or fsync"}} };
+		return;
+	}
+
 	std::vector<size_t> enteredIds = {};
+	std::vector<std::pair<collection_t*, uint64_t>> saveTickets = {}; // 1. collection 2. ticket of its save
 	for (const auto& item : documents.items()) {
 		const std::string colName = item.key();
 		const nlohmann::json docArray = item.value();
@@ -21,11 +30,28 @@ void CRUD::create(nlohmann::json& documents, nlohmann::json& response)
 		if (!collections.count(colName)) {
 			std::filesystem::create_directories(DATA_PATH + "/col_" + colName);
 			collections[colName] = new collection_t(colName);
+			collections[colName]->saveMetadata(DATA_PATH); // so that it gets loaded (and its log replayed) after a crash
+		}
+
+		// Enter all Documents and insert new Ids (fails when the write-ahead log has failed, the outcome is unknown
+		// when it cannot meet the write concern of the entered documents)
+		try {
+			std::vector<size_t> curIds = collections[colName]->insertDocuments(docArray.get<std::vector<nlohmann::json>>(), concern);
+			enteredIds.insert(enteredIds.end(), curIds.begin(), curIds.end());
+		}
+		catch (const write_unknown_t& ex) {
+			enteredIds.insert(enteredIds.end(), ex.ids.begin(), ex.ids.end());
+			response = { {"status", "unknown"}, {"error", {"WriteUnknown", ex.what()}}, {"newIds", enteredIds} };
+			return;
+		}
+		catch (const std::runtime_error& ex) {
+			response = { {"status", "failed"}, {"error", {"WriteFailed", ex.what()}}, {"newIds", enteredIds} };
+			return;
 		}
 
-		// Enter all Documents and insert new Ids
-		std::vector<size_t> curIds = collections[colName]->insertDocuments(docArray.get<std::vector<nlohmann::json>>());
-		enteredIds.insert(enteredIds.end(), curIds.begin(), curIds.end());	
+		// Let the collection be saved (with the write-ahead log the write concern is met already)
+		if (!WAL_ACTIVE)
+			saveTickets.push_back({ collections[colName], getSaveScheduler().markDirty(collections[colName]) });
 	}
 
 	response = {
@@ -33,6 +59,15 @@ void CRUD::create(nlohmann::json& documents, nlohmann::json& response)
 		{"newIds", enteredIds}
 	};
 
-	// Let the database be saved
-	std::thread(saveDatabase, DATA_PATH).detach();
+	// Answer after the saves when the write concern asks for it (a failed save leaves the documents in memory,
+	// the next save tries again)
+	if (concern == WriteConcern::None)
+		return;
+	try {
+		for (const auto& [col, saveTicket] : saveTickets)
+			getSaveScheduler().waitSaved(col, saveTicket);
+	}
+	catch (const std::runtime_error& ex) {
+		response = { {"status", "unknown"}, {"error", {"WriteUnknown", ex.what()}}, {"newIds", enteredIds} };
+	}
 }
\ No newline at end of file
@@ -7,6 +7,8 @@
 #include <string>
 #include <thread>
 #include <chrono>
+#include <mutex>
+#include <atomic>
 
 #include <nlohmann/json.hpp>
 #include "../database.h"
@@ -88,6 +90,8 @@ namespace SELECT {
 	};
 
 	inline std::map<std::string, cursor_t*> Cursors = {}; // uuid, cursor
+	inline std::mutex CursorsLock; // parallel selects register and kill cursors at the same time
+	inline std::atomic<size_t> CursorCounter = 0; // keeps uuids of cursors made in the same millisecond apart
 }
 
 #endif
\ No newline at end of file
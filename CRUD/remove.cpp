@@ -4,6 +4,7 @@
 #include "crud.h"
 #include "../main.h"
 #include "../database.h"
+#include "../scheduler.h"
 
 void CRUD::remove(nlohmann::json& request, nlohmann::json& response) {
 	if (!request.contains("query") | !request.contains("collection")) {
@@ -11,6 +12,13 @@ void CRUD::remove(nlohmann::json& request, nlohmann::json& response) {
 		return;
 	}
 
+	// When the answer is sent (see WriteConcern)
+	WriteConcern concern;
+	if (!readWriteConcern(request, concern)) {
+		response = { {"status", "failed"}, {"error", {"InvalidWriteConcern", "writeConcern has to be none, buffered or fsync"}} };
+		return;
+	}
+
 	// Parse request
 	nlohmann::json query = request["query"];
 	std::string collectionName = request["collection"].get<std::string>();
@@ -37,18 +45,33 @@ void CRUD::remove(nlohmann::json& request, nlohmann::json& response) {
 	}
 
 	// Delete in every storage
-	if (collections.count(collectionName)) {
-		for(const auto& storage : collections[collectionName]->storage) {
-			for (const auto& id : docIds) {
-				if (storage->removeDocument(id))
-					++effectedDocs; // Got removed
-			}
-				
-		}
-	}	
+	// (fails when the write-ahead log has failed, the outcome is unknown when it cannot meet the write concern)
+	try {
+		if (collections.count(collectionName))
+			effectedDocs = collections[collectionName]->removeDocuments(docIds, concern);
+	}
+	catch (const write_unknown_t& ex) {
+		response = { {"status", "unknown"}, {"error", {"WriteUnknown", ex.what()}}, {"effectedDocuments", ex.effectedDocuments} };
+		return;
+	}
+	catch (const std::runtime_error& ex) {
+		response = { {"status", "failed"}, {"error", {"WriteFailed", ex.what()}} };
+		return;
+	}
 
 	response = { {"status", "ok"}, {"effectedDocuments", effectedDocs} };
 
-	// Save Database and perform Removes
-	std::thread(saveDatabase, DATA_PATH).detach();
+	// Save the collection and perform Removes (with the write-ahead log the write concern is met already).
+	// Answer after the save when the write concern asks for it (a failed save leaves the change in memory,
+	// the next save tries again)
+	if (!WAL_ACTIVE && collections.count(collectionName)) {
+		const uint64_t saveTicket = getSaveScheduler().markDirty(collections[collectionName]);
+		try {
+			if (concern != WriteConcern::None)
+				getSaveScheduler().waitSaved(collections[collectionName], saveTicket);
+		}
+		catch (const std::runtime_error& ex) {
+			response = { {"status", "unknown"}, {"error", {"WriteUnknown", ex.what()}}, {"effectedDocuments", effectedDocs} };
+		}
+	}
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <thread>
 #include <chrono>
 #include <mutex>
+#include <limits>
 
 #include <algorithm> 
 #include <nlohmann/json.hpp>
@@ -57,7 +58,10 @@ void CRUD::select(nlohmann::json& request, nlohmann::json& response) {
 
 		// Make Cursor and return uuid of it
 		SELECT::cursor_t* cursor = new SELECT::cursor_t(query.queryCol, results, projection);
-		SELECT::Cursors[cursor->myID] = cursor;
+		{
+			std::lock_guard<std::mutex> cursorsGuard(SELECT::CursorsLock);
+			SELECT::Cursors[cursor->myID] = cursor;
+		}
 		response = { {"status", "ok"}, {"cursor_uuid", cursor->myID}, {"count", results.size()} };
 	}
 	catch (nlohmann::json errorMsg) {
@@ -71,7 +75,7 @@ namespace SELECT {
 	cursor_t::cursor_t(collection_t* queryCol, std::vector<std::tuple<size_t, float>>& ids, std::map<std::string, bool> projection, size_t batchSize, size_t timeout) {
 		const auto time_since_epoch = std::chrono::system_clock::now().time_since_epoch();
 		const long long milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(time_since_epoch).count();
-		this->myID = sha256(std::to_string(milliseconds));
+		this->myID = sha256(std::to_string(milliseconds) + "-" + std::to_string(CursorCounter++));
 		
 		this->queryCol = (queryCol);
 		this->ids = (ids);
@@ -108,37 +112,32 @@ namespace SELECT {
 		std::unique_lock<std::mutex> lockGuard(this->batchLock, std::defer_lock);
 		lockGuard.lock();
 
+		// Get documents (all of them at once, grouped by storage). 1.75 batches are kept
+		// ready (batchSize is the maximum when everything is requested)
+		const size_t wanted = this->batchSize < std::numeric_limits<size_t>::max() / 2 ? this->batchSize + this->batchSize * 3 / 4 : this->batchSize;
+		if (this->documents.size() >= wanted)
+			return; // Enough waiting
+
+		const size_t count = std::min(wanted - this->documents.size(), this->ids.size());
+		std::vector<size_t> batchIds(count);
+		for (size_t i = 0; i < count; ++i)
+			batchIds[i] = std::get<0>(this->ids[i]);
+
 		std::vector<nlohmann::json> docs;
-		std::vector<size_t> vectorIds;
+		this->queryCol->getDocuments(batchIds, docs, projection);
 
-		// Get documents
-		while (this->documents.size() < size_t(this->batchSize * 1.75) && this->ids.size() > 0) {
-			// Get first element
-			const auto [id, score] = this->ids[0];
-			
-			
-			for (const auto& storage : this->queryCol->storage) {
-				if (storage->savedHere(id)) {
-					// Saved in this storage
-					docs = {};
-					vectorIds = {id};
-
-					// Get document
-					storage->getDocuments(&vectorIds, docs, false, projection);
-					if (docs.size()) {
-						// If it found something
-						this->documents.push_back({ currentDocIndex, score, docs[0] });
-						++currentDocIndex;
-					}
-								
-					break;
-				}
-			}
+		// Keep the score order
+		for (size_t i = 0; i < count; ++i) {
+			if (docs[i].is_null())
+				continue; // Does not exist anymore
 
-			// Erase here, because it is now inside documents
-			this->ids.erase(this->ids.begin());
+			this->documents.push_back({ currentDocIndex, std::get<1>(this->ids[i]), std::move(docs[i]) });
+			++currentDocIndex;
 		}
 
+		// Erase here, because it is now inside documents
+		this->ids.erase(this->ids.begin(), this->ids.begin() + count);
+
 		lockGuard.unlock();
 	}
 
@@ -146,6 +145,8 @@ namespace SELECT {
 		while (this->documents.size() < this->batchSize && this->ids.size() > 0)
 			std::this_thread::sleep_for(std::chrono::nanoseconds(500)); // Wait because something is in work
 
+		std::unique_lock<std::mutex> lockGuard(this->batchLock);
+
 		// Get amount
 		size_t endIndex = 0;
 		if (this->documents.size() < this->batchSize || this->documents.size() == this->batchSize)
@@ -160,16 +161,23 @@ namespace SELECT {
 			this->documents.erase(this->documents.begin(), this->documents.begin() + endIndex);
 		}	
 
-		// Make new batches
-		std::thread(&cursor_t::makeBatch, this).detach();
-
 		// Return true, when no documents and no ids left (<== When it finished)...
-		return (this->documents.size() == 0 && this->ids.size() == 0);
+		const bool hasFinished = (this->documents.size() == 0 && this->ids.size() == 0);
+		lockGuard.unlock();
+
+		// Make new batches (a finished cursor gets killed, so nothing may run on it afterwards)
+		if (!hasFinished)
+			std::thread(&cursor_t::makeBatch, this).detach();
+
+		return hasFinished;
 	}
 
 	void cursor_t::killCursor(cursor_t* cursor)
 	{
-		SELECT::Cursors.erase(cursor->myID);
+		{
+			std::lock_guard<std::mutex> cursorsGuard(SELECT::CursorsLock);
+			SELECT::Cursors.erase(cursor->myID);
+		}
 		delete cursor;
 	}
 
@@ -178,17 +186,20 @@ namespace SELECT {
 
 		// Find timed out cursors
 		std::vector<cursor_t*> killOrder;
+		std::unique_lock<std::mutex> cursorsGuard(CursorsLock);
 		for (const auto& pair : Cursors) {
 			const auto diff = nowTime - pair.second->lastInteraction;
 
 			if (diff >= pair.second->timeout) // Timeout reached or over
 				killOrder.push_back(pair.second);
 		}
+		cursorsGuard.unlock();
 
 		// Kill them (if possible)
 		for (const auto& cursor : killOrder)
 			cursor_t::killCursor(cursor);
 
+		cursorsGuard.lock();
 		if (Cursors.size() == 0 && killOrder.size())
 			Cursors.clear(); // Clear to deallocate memory completely
 	}
@@ -249,7 +260,9 @@ namespace SELECT {
 						// Is KeyValue Index
 						std::shared_ptr<DbIndex::KeyValueIndex_t>  index = std::static_pointer_cast<DbIndex::KeyValueIndex_t>(ptr);
 						std::vector<std::string> indexData = { queryValue.dump() };
-						results = index->perform(indexData)[0];					
+						const auto found = index->perform(indexData);
+						if (found.size()) // Empty while the index is not built yet
+							results = found[0];
 					}
 					else if (type == DbIndex::IndexType::MultipleKeyValueIndex) {
 						// Is MultipleValue Index
@@ -268,7 +281,7 @@ namespace SELECT {
 		if (allSelected) {
 			// Add all Docs
 			std::vector<size_t> idContainer;
-			for (const auto& storage : this->queryCol->storage)
+			for (const auto& storage : this->queryCol->getStorages())
 				storage->getAllIds(idContainer);
 
 			this->addResults(idContainer.begin(), idContainer.end());
@@ -316,6 +329,7 @@ namespace SELECT {
 	///		fieldName, std::string
 	///		value, std::vector<float>
 	///		k, size_t (optional)
+	///		ef, size_t (optional, candidates of the search: more = better recall, but slower)
 	/// </summary>
 	void similarOperator(const nlohmann::json& query, query_t* queryObject) {
 		// Exceptions
@@ -339,6 +353,14 @@ namespace SELECT {
 		else // Set to default all Documents
 			kValue = queryObject->queryCol->countDocuments();	
 
+		// Get ef (0 = the one of the index)
+		size_t efValue = 0;
+		if (query.contains("ef")) {
+			if (!query["ef"].is_number_unsigned() || query["ef"].get<size_t>() == 0)
+				throw nlohmann::json({ {"WrongType", "ef has to be a positive integer!"}, {"Input", query["ef"]} });
+			efValue = query["ef"].get<size_t>();
+		}
+
 		// Get Index to fieldname
 		std::shared_ptr<DbIndex::KnnIndex_t> knnIndex = nullptr;
 		for (const auto& [keyName, type, ptr] : queryObject->indexedKeys) {
@@ -354,7 +376,7 @@ namespace SELECT {
 
 		// Finally Perform Index. results[0] has the farest distance
 		std::priority_queue<std::pair<float, hnswlib::labeltype>> results;
-		knnIndex->perform(value, &results, kValue);
+		knnIndex->perform(value, &results, kValue, efValue);
 
 		// Because the keyValue Selection adds always 1.000 to the maxScore and we do not 
 		// want that this function can overwhelm the keyValue Selection, we only add
@@ -365,23 +387,20 @@ namespace SELECT {
 		//						maxDistance / 850		<=== denominator
 		//
 
-		if (results.size()) {		
-			float maxDistance = -1, denominator = -1;
-
-			while(!results.empty()) {
-				// Get item
-				auto [currentDistance, id] = results.top();
+		if (results.size()) {
+			// Farthest first. Inner product distances can be negative: they get shifted, so that the nearest one is 0 at least
+			std::vector<std::pair<float, hnswlib::labeltype>> ordered = {};
+			ordered.reserve(results.size());
+			while (!results.empty()) {
+				ordered.push_back(results.top());
 				results.pop();
+			}
 
-				if (maxDistance < 0) { 
-					// First One has the farest distance
-					maxDistance = currentDistance + 1;
-					denominator = maxDistance / 850;
-				}
-				
-
-				queryObject->scores[id] += (maxDistance - currentDistance) / denominator;
-			}		
+			const float shift = std::max(0.0f, -ordered.back().first);
+			const float maxDistance = ordered.front().first + shift + 1;
+			const float denominator = maxDistance / 850;
+			for (const auto& [currentDistance, id] : ordered)
+				queryObject->scores[id] += (maxDistance - (currentDistance + shift)) / denominator;
 		}
 	}
 
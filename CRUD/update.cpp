@@ -4,6 +4,7 @@
 #include "crud.h"
 #include "../main.h"
 #include "../database.h"
+#include "../scheduler.h"
 
 void CRUD::update(nlohmann::json& request, nlohmann::json& response) {
 	if (!request.contains("query") | !request.contains("update") | !request.contains("collection")) {
@@ -11,6 +12,13 @@ void CRUD::update(nlohmann::json& request, nlohmann::json& response) {
 		return;
 	}
 
+	// When the answer is sent (see WriteConcern)
+	WriteConcern concern;
+	if (!readWriteConcern(request, concern)) {
+		response = { {"status", "failed"}, {"error", {"InvalidWriteConcern", "writeConcern has to be none, buffered or fsync"}} };
+		return;
+	}
+
 	// Parse Request
 	nlohmann::json query = request["query"];
 	const nlohmann::json update = request["update"];
@@ -40,34 +48,35 @@ void CRUD::update(nlohmann::json& request, nlohmann::json& response) {
 
 
 	// Give storage the command to update them
-	if (collections.count(collectionName)) {
-		auto func = [&effectedDocuments, &docIds, &update](group_storage_t* storage) {
-			for (const size_t& currentId : docIds) {
-				if (!storage->savedHere(currentId))
-					continue;
-
-				++effectedDocuments;
-				storage->editDocument(currentId, update);
-			}
-		};
-
-		// Start Worker
-		std::vector<std::thread> worker;
-		for (const auto& storage : collections[collectionName]->storage)
-			worker.push_back(std::thread(func, storage));
-
-		// Wait for all to finish
-		for (size_t i = 0; i < worker.size(); ++i)
-		{
-			if (worker[i].joinable())
-				worker[i].join();
-		}
+	// (fails when the write-ahead log has failed, the outcome is unknown when it cannot meet the write concern)
+	try {
+		if (collections.count(collectionName))
+			effectedDocuments = collections[collectionName]->updateDocuments(docIds, update, concern);
+	}
+	catch (const write_unknown_t& ex) {
+		response = { {"status", "unknown"}, {"error", {"WriteUnknown", ex.what()}}, {"effectedDocuments", ex.effectedDocuments} };
+		return;
+	}
+	catch (const std::runtime_error& ex) {
+		response = { {"status", "failed"}, {"error", {"WriteFailed", ex.what()}} };
+		return;
 	}
 
 	response = { {"status", "ok"}, {"effectedDocuments", effectedDocuments} };
 
-	// Save Database and perform Edits
-	std::thread(saveDatabase, DATA_PATH).detach();
+	// Save the collection and perform Edits (with the write-ahead log the write concern is met already).
+	// Answer after the save when the write concern asks for it (a failed save leaves the change in memory,
+	// the next save tries again)
+	if (!WAL_ACTIVE && collections.count(collectionName)) {
+		const uint64_t saveTicket = getSaveScheduler().markDirty(collections[collectionName]);
+		try {
+			if (concern != WriteConcern::None)
+				getSaveScheduler().waitSaved(collections[collectionName], saveTicket);
+		}
+		catch (const std::runtime_error& ex) {
+			response = { {"status", "unknown"}, {"error", {"WriteUnknown", ex.what()}}, {"effectedDocuments", effectedDocuments} };
+		}
+	}
 }
 
 
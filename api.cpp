@@ -32,13 +32,19 @@ namespace Endpoints {
 				return;
 			}
 
-			if (!SELECT::Cursors.count(query_params["cursor_uuid"])) {
+			// Get Cursor
+			SELECT::cursor_t* cursor = nullptr;
+			{
+				std::lock_guard<std::mutex> cursorsGuard(SELECT::CursorsLock);
+				auto it = SELECT::Cursors.find(query_params["cursor_uuid"]);
+				if (it != SELECT::Cursors.end())
+					cursor = it->second;
+			}
+
+			if (!cursor) {
 				API::writeJSON(response, { {"status", "failed"}, {"CannotFind", "No cursor is listed with this uuid"}, {"input", query_params["cursor_uuid"]} });
 				return;
 			}
-
-			// Get Cursor
-			SELECT::cursor_t* cursor = SELECT::Cursors[query_params["cursor_uuid"]];
 			std::vector<nlohmann::json> documents = {};
 
 			// get all? Yes ==> set batch_size to ids.size() and make batch
@@ -53,10 +59,59 @@ namespace Endpoints {
 				std::thread(SELECT::cursor_t::killCursor, cursor).detach();
 
 			API::writeJSON(response, { {"status", "ok"}, {"count", documents.size()}, {"items", documents}, {"finished", hasFinished} });
-		}	
+		}
+
+		void collection(std::shared_ptr<HttpServer::Response> response, std::shared_ptr<HttpServer::Request> request)
+		{
+			// Storage statistics (fragmentation) of one collection or of all of them
+			auto query_params = API::parseQueryString(request);
+
+			if (query_params.count("name")) {
+				if (!collections.count(query_params["name"])) {
+					API::writeJSON(response, { {"status", "failed"}, {"CannotFind", "No collection is listed with this name"}, {"input", query_params["name"]} });
+					return;
+				}
+
+				API::writeJSON(response, { {"status", "ok"}, {"collection", CollectionFunctions::getStatistics(collections[query_params["name"]])} });
+				return;
+			}
+
+			nlohmann::json statistics = nlohmann::json::array();
+			for (const auto& item : collections)
+				statistics.push_back(CollectionFunctions::getStatistics(item.second));
+
+			API::writeJSON(response, { {"status", "ok"}, {"collections", statistics} });
+		}
 	}
 
 	namespace POST {
+		void collection(std::shared_ptr<HttpServer::Response> response, std::shared_ptr<HttpServer::Request> request)
+		{
+			// Change settings of a collection: {"name": ..., "compressionLevel": 0-9}
+			nlohmann::json postBody;
+			if (!API::parseBody(request, postBody)) {
+				API::writeJSON(response, postBody, "400 Bad Request");
+				return;
+			}
+
+			if (!postBody.contains("name") || !postBody["name"].is_string() || !collections.count(postBody["name"].get<std::string>())) {
+				API::writeJSON(response, { {"status", "failed"}, {"CannotFind", "No collection is listed with this name"}, {"input", postBody.value("name", nlohmann::json())} });
+				return;
+			}
+			collection_t* col = collections[postBody["name"].get<std::string>()];
+
+			if (postBody.contains("compressionLevel")) {
+				if (!postBody["compressionLevel"].is_number_integer() || postBody["compressionLevel"].get<int>() < 0 || postBody["compressionLevel"].get<int>() > 9) {
+					API::writeJSON(response, { {"status", "failed"}, {"WrongType", "compressionLevel has to be an integer between 0 and 9"}, {"got", postBody["compressionLevel"]} });
+					return;
+				}
+				col->setCompressionLevel(postBody["compressionLevel"].get<int>());
+			}
+
+			col->saveMetadata(DATA_PATH);
+			API::writeJSON(response, { {"status", "ok"}, {"collection", CollectionFunctions::getStatistics(col)} });
+		}
+
 		void indexes(std::shared_ptr<HttpServer::Response> response, std::shared_ptr<HttpServer::Request> request)
 		{
 			// Parse Body
@@ -88,7 +143,12 @@ namespace Endpoints {
 
 				// Define index
 				if (indexOp.contains("definition") && indexOp["definition"].is_object()) {
-					if (collections[colName]->indexes.count(indexName)) {
+					nlohmann::json definition = indexOp["definition"];
+					definition["name"] = indexName;
+
+					// Create Index, set and directly build it
+					std::shared_ptr<DbIndex::Iindex_t> index = DbIndex::loadIndexFromJSON(definition);
+					if (!collections[colName]->addIndex(indexName, index)) {
 						// Index is already defined
 						API::writeJSON(response, {
 							{"status", "ok"},
@@ -97,17 +157,14 @@ namespace Endpoints {
 						});
 						return;
 					}
-
-					nlohmann::json definition = indexOp["definition"];
-					definition["name"] = indexName;
-
-					// Create Index, set and directly build it
-					std::shared_ptr<DbIndex::Iindex_t> index = DbIndex::loadIndexFromJSON(definition);
-					collections[colName]->indexes[indexName] = index;
 					rebuildIndexes.insert(colName);
 				}
 			}
 
+			// Write the new definitions down (they are not part of the write-ahead log)
+			for (const std::string& colName : rebuildIndexes)
+				collections[colName]->saveMetadata(DATA_PATH);
+
 			// Succed everything
 			API::writeJSON(response, { {"status", "ok"} });
 
@@ -155,15 +212,7 @@ namespace Endpoints {
 
 				// Set post-processing
 				{
-					// Index Rebuildings
-					if (route.find("/create") != std::string::npos) {
-						// Extract collections
-						for (const auto& newDocs : item["value"].items()) {
-							if(collections.count(newDocs.key()))
-								rebuildIndexes.insert(newDocs.key());
-						}
-					}
-						
+					// Index Builds (new documents are indexed on their own)
 					if (route.find("/index") != std::string::npos) {
 						// Extract collections
 						for (const auto& definition : item["value"]) {
@@ -226,34 +275,12 @@ namespace Endpoints {
 					return;
 				}
 
-				// Parse Query Parameter
-				std::map<std::string, std::string> queryParameter = API::parseQueryString(request);
-
 				// Perform CRUD
 				nlohmann::json crudResult = {};
 				func(postBody, crudResult);
 
-				// Response
+				// Response (the indexes got the changes already)
 				API::writeJSON(response, crudResult);
-
-				// Post Processing
-				if (operation == "create") {
-					// Rebuild Indexes
-					{
-						std::set<std::string> rebuildIndexes = {};
-						if (!queryParameter.count("bulk") && !TrueWritings.count(queryParameter["bulk"])) {
-							// Extract collections
-							for (const auto& elements : postBody.items()) {
-								const std::string colName = elements.key();
-								if (collections.count(colName))
-									rebuildIndexes.insert(colName);
-							}
-						}
-
-						for (const std::string colName : rebuildIndexes)
-							std::thread(&collection_t::BuildIndexes, collections[colName]).detach();
-					}
-				}
 			};
 		}
 	}
@@ -273,7 +300,7 @@ namespace Endpoints {
 					// Fire Function
 					func(response, request);
 				}
-				catch (std::exception ex) {
+				catch (const std::exception& ex) {
 					// Log Error in console
 					std::cout << "Error on handling Client: " << std::endl;
 					std::cout << "	- Method: " << request->method << std::endl;
@@ -339,9 +366,11 @@ namespace API {
 		//	GET METHODS
 		server.resource["^/$"]["GET"] = Endpoints::Preprocessing(Endpoints::GET::index);
 		server.resource["^/cursor$"]["GET"] = Endpoints::Preprocessing(Endpoints::GET::cursor);
+		server.resource["^/collection$"]["GET"] = Endpoints::Preprocessing(Endpoints::GET::collection);
 
 
 		// POST METHODS
+		server.resource["^/collection$"]["POST"] = Endpoints::Preprocessing(Endpoints::POST::collection);
 		server.resource["^/index$"]["POST"] = Endpoints::Preprocessing(Endpoints::POST::indexes);
 		server.resource["^/bulk$"]["POST"] = Endpoints::Preprocessing(Endpoints::POST::bulk);
 
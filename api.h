@@ -34,6 +34,7 @@ namespace Endpoints {
 	}
 
 	namespace POST {
+		void collection(std::shared_ptr<HttpServer::Response> response, std::shared_ptr<HttpServer::Request> request);
 		void indexes(std::shared_ptr<HttpServer::Response> response, std::shared_ptr<HttpServer::Request> request);
 		void bulk(std::shared_ptr<HttpServer::Response> response, std::shared_ptr<HttpServer::Request> request);
 
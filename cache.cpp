@@ -0,0 +1,118 @@
+#include "cache.h"
+
+// Rough per entry overhead (list node, map node and the shared document)
+const size_t CACHE_ENTRY_OVERHEAD = 128;
+
+size_t parsedSize(const nlohmann::json& value)
+{
+	// Estimated bytes of a parsed json value with everything it allocates (short strings live inside the string itself)
+	auto stringSize = [](const std::string& text) { return sizeof(std::string) + (text.capacity() > 15 ? text.capacity() + 1 : 0); };
+	size_t size = sizeof(nlohmann::json);
+
+	switch (value.type()) {
+	case nlohmann::json::value_t::string:
+		size += stringSize(value.get_ref<const std::string&>());
+		break;
+	case nlohmann::json::value_t::object:
+		size += sizeof(nlohmann::json::object_t);
+		for (const auto& item : value.items())
+			size += 4 * sizeof(void*) + stringSize(item.key()) + parsedSize(item.value()); // tree node, key and value
+		break;
+	case nlohmann::json::value_t::array:
+		size += sizeof(nlohmann::json::array_t) + (value.get_ref<const nlohmann::json::array_t&>().capacity() - value.size()) * sizeof(nlohmann::json);
+		for (const auto& item : value)
+			size += parsedSize(item);
+		break;
+	case nlohmann::json::value_t::binary:
+		size += sizeof(nlohmann::json::binary_t) + value.get_binary().size();
+		break;
+	default:
+		break;
+	}
+	return size;
+}
+
+document_cache_t::document_cache_t(size_t budgetBytes)
+{
+	this->budgetBytes = budgetBytes;
+}
+
+bool document_cache_t::get(size_t id, std::shared_ptr<const nlohmann::json>& document)
+{
+	std::unique_lock<std::mutex> lockGuard(this->cacheLock);
+	const auto position = this->positions.find(id);
+
+	if (position == this->positions.end()) {
+		++this->misses;
+		return false;
+	}
+
+	// Move it to the front (most recently used)
+	this->entries.splice(this->entries.begin(), this->entries, position->second);
+	document = position->second->document;
+	++this->hits;
+	return true;
+}
+
+void document_cache_t::put(size_t id, std::shared_ptr<const nlohmann::json> document)
+{
+	const size_t size = CACHE_ENTRY_OVERHEAD + parsedSize(*document);
+	if (size > this->budgetBytes)
+		return; // Would evict everything
+
+	std::unique_lock<std::mutex> lockGuard(this->cacheLock);
+	const auto position = this->positions.find(id);
+	if (position != this->positions.end()) {
+		this->usedBytes -= position->second->size;
+		this->entries.erase(position->second);
+	}
+
+	this->entries.push_front({ id, size, std::move(document) });
+	this->positions[id] = this->entries.begin();
+	this->usedBytes += size;
+	this->evict();
+}
+
+void document_cache_t::invalidate(size_t id)
+{
+	std::unique_lock<std::mutex> lockGuard(this->cacheLock);
+	const auto position = this->positions.find(id);
+	if (position == this->positions.end())
+		return;
+
+	this->usedBytes -= position->second->size;
+	this->entries.erase(position->second);
+	this->positions.erase(position);
+}
+
+void document_cache_t::clear()
+{
+	std::unique_lock<std::mutex> lockGuard(this->cacheLock);
+	this->entries.clear();
+	this->positions.clear();
+	this->usedBytes = 0;
+}
+
+void document_cache_t::evict()
+{
+	// Drop the least recently used ones until it fits into the budget again.
+	// cacheLock has to be held by the caller
+	while (this->usedBytes > this->budgetBytes && this->entries.size()) {
+		this->usedBytes -= this->entries.back().size;
+		this->positions.erase(this->entries.back().id);
+		this->entries.pop_back();
+	}
+}
+
+nlohmann::json document_cache_t::getStatistics()
+{
+	std::unique_lock<std::mutex> lockGuard(this->cacheLock);
+
+	return {
+		{"documents", this->entries.size()},
+		{"bytes", this->usedBytes},
+		{"budget", this->budgetBytes},
+		{"hits", this->hits.load()},
+		{"misses", this->misses.load()}
+	};
+}
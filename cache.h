@@ -0,0 +1,44 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#include <atomic>
+
+#include <nlohmann/json.hpp>
+
+// Parsed documents of one collection (shared by all its storages) in least recently
+// used order. Documents are handed out without a copy (they never change, an edit invalidates them).
+// The memory budget is counted in estimated bytes of the parsed documents
+class document_cache_t {
+private:
+	struct entry_t {
+		size_t id;
+		size_t size;
+		std::shared_ptr<const nlohmann::json> document;
+	};
+
+	std::mutex cacheLock;
+	std::list<entry_t> entries; // most recently used first
+	std::unordered_map<size_t, std::list<entry_t>::iterator> positions; // 1. id of doc 2. entry
+	size_t usedBytes = 0;
+	size_t budgetBytes = 0;
+
+	void evict();
+
+public:
+	std::atomic<size_t> hits = 0;
+	std::atomic<size_t> misses = 0;
+
+	document_cache_t(size_t budgetBytes);
+
+	bool get(size_t id, std::shared_ptr<const nlohmann::json>& document);
+	void put(size_t id, std::shared_ptr<const nlohmann::json> document);
+	void invalidate(size_t id);
+	void clear();
+	nlohmann::json getStatistics();
+};
+
+#endif // !CACHE_H
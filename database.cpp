@@ -1,13 +1,17 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <filesystem>
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <set>
 #include <chrono>
 #include <thread>
 #include <random>
+#include <algorithm>
+#include <cmath>
 
 #include <nlohmann/json.hpp>
 #include "hnswlib.h"
@@ -16,6 +20,28 @@
 #include "main.h"
 #include "database.h"
 #include "storage.h"
+#include "workers.h"
+#include "CRUD/crud.h"
+
+
+const size_t MAX_SHARD_DEPTH = 16; // the shard directory has at most 2^16 slots
+const size_t SHARD_MOVE_BATCH = 1000; // documents which are moved to their shard at once
+const float MAX_GRAPH_DELETIONS = 0.5f; // share of deleted points which lets a saved KNN graph be built again
+
+size_t hashDocumentId(size_t id)
+{
+	// splitmix64 finalizer: Spreads sequential ids evenly and is the same on every platform
+	uint64_t value = uint64_t(id) + 0x9E3779B97F4A7C15ULL;
+	value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+	return size_t(value ^ (value >> 31));
+}
+
+std::string getGraphPath(const std::string& collectionPath, const std::string& indexName, uint64_t generation)
+{
+	// Saved graph of a KNN index. It only belongs to the documents of this generation (the newest change inside the storage files)
+	return collectionPath + "/index_" + indexName + "." + std::to_string(generation) + ".hnsw";
+}
 
 
 //	*** LOADING ***
@@ -38,6 +64,10 @@ void loadCollection(std::string collectionPath) {
 	// Create collection and set metadata
 	collection_t* col = new collection_t(metadata["name"]);
 	collections[metadata["name"]] = col;
+	col->savedMetadata = metadata.dump();
+
+	if (metadata.contains("compressionLevel"))
+		col->compressionLevel = metadata["compressionLevel"].get<int>();
 
 	// Set indexes
 	if (metadata.contains("indexes") && metadata["indexes"].is_array()) {
@@ -64,15 +94,15 @@ void loadCollection(std::string collectionPath) {
 		// Load .KNNDB File in another Thread 
 		workers.push_back(std::thread([file, col, &coutLock]() {
 			try {
-				group_storage_t* storage = new group_storage_t(file.path().u8string());
+				group_storage_t* storage = new group_storage_t(file.path().u8string(), col->cache.get(), col->compressionLevel, &col->mutationLock);
+				std::unique_lock<std::shared_mutex> lockGuard(col->storageListLock);
 				col->storage.push_back(storage);
 			}
-			catch (std::exception ex) {
-				// File is corrupted
-				// ==> happens when new created documents are inserted and the program exits when it never 
-				//		wrote down or when it is writing down and the program exits. Then the other file 
-				//		should yet exist and we can savely remove this file (new created docs are unlucky/maybe later we fix that (: )
-				std::filesystem::remove(file);
+			catch (const std::exception& ex) {
+				// Cannot be read at all (damaged rows are already cut off by the storage itself)
+				// ==> keep the file untouched for a manual recovery and go on without it
+				std::unique_lock<std::mutex> lockGuard(coutLock);
+				std::cout << "[WARNING] Cannot load storage file " << file.path().u8string() << ": " << ex.what() << " ==> skipped" << std::endl;
 			}
 		}));
 	}
@@ -84,7 +114,57 @@ void loadCollection(std::string collectionPath) {
 			workers[i].join();
 	}
 
-	// Build indexes in the background
+	// Remember which storage contains which document and which storages are shards
+	for (const auto& storage : col->storage)
+		col->registerDocuments(storage, storage->getAllIds());
+	col->loadShards(metadata);
+
+	// Replay all changes which were logged after the last checkpoint
+	if (WAL_ACTIVE)
+		col->openLog();
+
+	// Generation of the documents in memory: the newest change of every storage (replayed ones included)
+	for (const auto& storage : col->storage)
+		col->generation = std::max(col->generation, storage->getPendingLsn());
+
+	// KNN indexes take their saved graph when it was saved with exactly these documents. Others (and
+	// outdated graph files) are built again from the storages
+	std::set<std::string> loadedGraphs = {};
+	for (const auto& [indexName, index] : col->indexes) {
+		if (index->getType() != DbIndex::IndexType::KnnIndex)
+			continue;
+
+		auto knnIndex = std::static_pointer_cast<DbIndex::KnnIndex_t>(index);
+		const std::string graphPath = getGraphPath(collectionPath, indexName, col->generation);
+		if (!std::filesystem::exists(graphPath) || !knnIndex->loadGraph(graphPath))
+			continue;
+
+		knnIndex->savedGeneration = col->generation;
+		knnIndex->finish();
+		loadedGraphs.insert(std::filesystem::path(graphPath).filename().u8string());
+	}
+
+	for (const auto& file : std::filesystem::directory_iterator(collectionPath)) {
+		const std::string fileName = file.path().filename().u8string();
+		const bool isGraph = fileName.size() > 5 && fileName.compare(fileName.size() - 5, 5, ".hnsw") == 0;
+		const bool isGraphTmp = fileName.size() > 9 && fileName.compare(fileName.size() - 9, 9, ".hnsw.tmp") == 0;
+		if ((isGraph || isGraphTmp) && !loadedGraphs.count(fileName))
+			std::filesystem::remove(file.path());
+	}
+	if (loadedGraphs.size())
+		std::cout << " (loaded " << loadedGraphs.size() << " saved KNN graphs)";
+
+	// Storages without documents (e.g. emptied by the compactor) are not needed anymore
+	// (an empty shard gets created again when a document is placed there)
+	std::vector<group_storage_t*> emptyStorages = {};
+	for (const auto& storage : col->storage) {
+		if (!storage->countDocuments())
+			emptyStorages.push_back(storage);
+	}
+	for (const auto& storage : emptyStorages)
+		col->removeStorage(storage);
+
+	// Build the other indexes in the background
 	std::thread(&collection_t::BuildIndexes, col).detach();
 }
 
@@ -107,67 +187,431 @@ void loadDatabase(std::string dataPath) {
 	std::cout << "[INFO] Loaded all Collections. Indexes are building in the background" << std::endl;
 }
 
-void saveDatabase(std::string dataPath) {
-	// Save Collections
-	for (const auto& col : collections) {
-		std::unique_lock<std::mutex> lockGuard(col.second->saveLock, std::defer_lock);
-		for (const auto storage : col.second->storage)
-			storage->save();
+void saveCollection(collection_t* col, std::string dataPath, bool withGraphs) {
+	// Checkpoint: Freeze the changes of every storage at the same point of the write-ahead log (copy on write,
+	// the writers go on with new change sets right away) and write the snapshots down in parallel. Afterwards
+	// the log only has to keep what came in during the save
+	// The writers of the storages come before the mutationLock (storages created in between need another try)
+	std::unique_lock<std::mutex> mutationGuard(col->mutationLock);
+	std::vector<group_storage_t*> storages = {};
+	std::vector<std::unique_lock<std::mutex>> writerGuards = {};
+	while (storages != col->storage) {
+		storages = col->storage;
+		mutationGuard.unlock();
+
+		writerGuards.clear();
+		for (const auto storage : storages)
+			writerGuards.push_back(storage->lockWriter());
+		mutationGuard.lock();
+	}
 
-		lockGuard.lock();
+	write_ahead_log_t* wal = col->wal.get();
+	const uint64_t checkpointLsn = wal != nullptr ? wal->getLastLsn() : 0;
+	std::vector<group_storage_t*> changedStorages = {};
+	uint64_t generation = 0;
+	for (const auto storage : storages) {
+		if (storage->takeSnapshot())
+			changedStorages.push_back(storage);
+		generation = std::max(generation, storage->getPendingLsn());
+	}
+
+	// Built KNN graphs which do not belong to this generation yet get written next to the snapshots. They are
+	// locked until they are copied into memory (changes of them wait), so that they contain exactly the documents
+	// of the snapshots
+	std::vector<std::pair<std::string, std::shared_ptr<DbIndex::KnnIndex_t>>> graphs = {};
+	std::vector<std::unique_lock<std::shared_mutex>> graphGuards = {};
+	for (const auto& [indexName, index] : col->indexes) {
+		if (!withGraphs || index->getType() != DbIndex::IndexType::KnnIndex || !index->createdAt)
+			continue;
+
+		auto knnIndex = std::static_pointer_cast<DbIndex::KnnIndex_t>(index);
+		if (knnIndex->savedGeneration != generation) {
+			graphGuards.push_back(std::unique_lock<std::shared_mutex>(knnIndex->graphLock));
+			graphs.push_back({ indexName, knnIndex });
+		}
+	}
+	mutationGuard.unlock();
+
+	std::vector<std::string> graphFiles(graphs.size());
+	for (size_t i = 0; i < graphs.size(); ++i) {
+		graphFiles[i] = graphs[i].second->saveGraph();
+		graphGuards[i].unlock();
+	}
+
+	// One writer per changed storage file and per graph
+	const std::string collectionPath = dataPath + "/col_" + col->name;
+	worker_pool_t& pool = getWorkerPool();
+	std::vector<std::future<void>> writes = {};
+	for (const auto storage : changedStorages)
+		writes.push_back(pool.push([storage]() { storage->writeSnapshot(); }));
+	for (size_t i = 0; i < graphs.size(); ++i) {
+		const std::string graphPath = getGraphPath(collectionPath, graphs[i].first, generation) + ".tmp";
+		writes.push_back(pool.push([&graphFiles, i, graphPath]() {
+			std::ofstream graphFile(graphPath, std::ios::out | std::ios::trunc | std::ios::binary);
+			graphFile.write(graphFiles[i].data(), graphFiles[i].size());
+			graphFile.close();
+			if (!graphFile)
+				throw std::runtime_error("Cannot write KNN graph: " + graphPath);
+		}));
+	}
+	pool.wait(writes);
+	graphFiles.clear();
+
+	// The graphs become valid after the storages are written (the old ones are outdated now). The writers
+	// are still held, so that no other save reads savedGeneration in the meantime
+	for (const auto& [indexName, knnIndex] : graphs) {
+		replaceFile(getGraphPath(collectionPath, indexName, generation) + ".tmp", getGraphPath(collectionPath, indexName, generation));
+		if (knnIndex->savedGeneration)
+			std::filesystem::remove(getGraphPath(collectionPath, indexName, knnIndex->savedGeneration));
+		knnIndex->savedGeneration = generation;
+	}
+	writerGuards.clear();
 
-		// Save Metadata to JSON-Object		
-		nlohmann::json dbMetadata;
-		dbMetadata["name"] = col.first;
-		dbMetadata["indexes"] = DbIndex::saveIndexesToString(col.second->indexes);
+	if (wal != nullptr)
+		wal->truncate(checkpointLsn);
 
-		// Write JSON down
-		std::ofstream metadataFile (dataPath + "/col_" + col.first + "/collection.metadata", std::fstream::trunc);
-		metadataFile << dbMetadata.dump();
-		metadataFile.close();
+	col->saveMetadata(dataPath);
+}
 
-		lockGuard.unlock();
+void saveDatabase(std::string dataPath) {
+	// Save Collections (with their KNN graphs). A failed one keeps its write-ahead log and is tried again
+	// with the next save, the others get saved nevertheless
+	for (const auto& col : collections) {
+		try {
+			saveCollection(col.second, dataPath, true);
+		}
+		catch (const std::exception& ex) {
+			std::cout << "[WARNING] Cannot save collection " << col.first << ": " << ex.what() << std::endl;
+		}
 	}
 }
 
 
+bool readWriteConcern(const nlohmann::json& request, WriteConcern& concern)
+{
+	// Without one the write-ahead log is waited for (it is fsynced), saves are not
+	concern = WAL_ACTIVE ? WriteConcern::Fsync : WriteConcern::None;
+	if (!request.contains("writeConcern"))
+		return true;
+	if (!request["writeConcern"].is_string())
+		return false;
+
+	const std::string name = request["writeConcern"].get<std::string>();
+	if (name == "none")
+		concern = WriteConcern::None;
+	else if (name == "buffered")
+		concern = WriteConcern::Buffered;
+	else if (name == "fsync")
+		concern = WriteConcern::Fsync;
+	else
+		return false;
+	return true;
+}
+
+
 //	*** collection_t ***
 collection_t::collection_t(std::string name)
 {
 	this->storage = {};
 	this->name = name;
+	this->compressionLevel = STORAGE_COMPRESSION_LEVEL;
+
+	while ((size_t(1) << this->minShardDepth) < STORAGE_SHARDS)
+		++this->minShardDepth;
+	this->shardDepth = this->minShardDepth;
+	this->shardDirectory.assign(size_t(1) << this->shardDepth, nullptr);
+
+	if (DOCUMENT_CACHE_SIZE)
+		this->cache = std::make_unique<document_cache_t>(DOCUMENT_CACHE_SIZE * 1024 * 1024);
 }
 
-std::vector<size_t> collection_t::insertDocuments(const std::vector<nlohmann::json> documents)
+void collection_t::saveMetadata(std::string dataPath)
 {
-	if (!documents.size())
-		return {}; // Emtpy
+	std::unique_lock<std::mutex> lockGuard(this->saveLock);
+
+	// Save Metadata to JSON-Object		
+	nlohmann::json dbMetadata;
+	dbMetadata["name"] = this->name;
+	dbMetadata["compressionLevel"] = this->compressionLevel;
+	std::shared_lock<std::shared_mutex> indexesGuard(this->indexesLock);
+	dbMetadata["indexes"] = DbIndex::saveIndexesToString(this->indexes);
+	indexesGuard.unlock();
+
+	std::unique_lock<std::mutex> shardGuard(this->shardLock);
+	dbMetadata["shardDepth"] = this->minShardDepth;
+	dbMetadata["shards"] = nlohmann::json::array();
+	for (const auto& [storage, shard] : this->shards)
+		dbMetadata["shards"].push_back({ {"file", storage->getPath().filename().u8string()}, {"depth", shard.first}, {"bucket", shard.second} });
+	shardGuard.unlock();
+
+	// Write JSON down when something changed (into a temporary file which replaces the old one, so that a crash never leaves a half written file)
+	const std::string content = dbMetadata.dump();
+	if (content == this->savedMetadata)
+		return;
+
+	const std::string metadataPath = dataPath + "/col_" + this->name + "/collection.metadata";
+	std::ofstream metadataFile(metadataPath + ".tmp", std::fstream::trunc);
+	metadataFile << content;
+	metadataFile.close();
+	replaceFile(metadataPath + ".tmp", metadataPath);
+	this->savedMetadata = content;
+}
+
+void collection_t::setCompressionLevel(int compressionLevel)
+{
+	// Storage files get (de)compressed by their next rewrite (the compactor picks them up)
+	this->compressionLevel = compressionLevel;
+	for (const auto& storage : this->getStorages())
+		storage->setCompressionLevel(compressionLevel);
+}
+
+void collection_t::loadShards(const nlohmann::json& metadata)
+{
+	// Take over the shards of the metadata. Storages which are not listed (written before the hash placement,
+	// or created right before a crash) or which overlap another shard are no shards: the compactor moves
+	// their documents into the shards of their ids
+	std::unique_lock<std::mutex> lockGuard(this->shardLock);
+	if (metadata.contains("shardDepth"))
+		this->minShardDepth = std::min(metadata["shardDepth"].get<size_t>(), MAX_SHARD_DEPTH);
+
+	std::unordered_map<std::string, group_storage_t*> storageFiles = {};
+	for (const auto& storage : this->storage)
+		storageFiles[storage->getPath().filename().u8string()] = storage;
+
+	std::vector<std::tuple<group_storage_t*, size_t, size_t>> listedShards = {};
+	this->shardDepth = this->minShardDepth;
+	for (const auto& shard : metadata.value("shards", nlohmann::json::array())) {
+		const auto storage = storageFiles.find(shard["file"].get<std::string>());
+		const size_t depth = shard["depth"].get<size_t>();
+		const size_t bucket = shard["bucket"].get<size_t>();
+		if (storage == storageFiles.end() || depth > MAX_SHARD_DEPTH || bucket >= (size_t(1) << depth))
+			continue; // File does not exist anymore (empty) or damaged entry
+
+		listedShards.push_back({ storage->second, depth, bucket });
+		this->shardDepth = std::max(this->shardDepth, depth);
+	}
+
+	this->shards.clear();
+	this->shardDirectory.assign(size_t(1) << this->shardDepth, nullptr);
+	for (const auto& [storage, depth, bucket] : listedShards) {
+		// Slots of a shard: every slot whose lowest depth bits are the bucket
+		bool overlaps = false;
+		for (size_t slot = bucket; slot < this->shardDirectory.size(); slot += size_t(1) << depth)
+			overlaps |= this->shardDirectory[slot] != nullptr;
+		if (overlaps)
+			continue;
+
+		this->shards[storage] = { depth, bucket };
+		for (size_t slot = bucket; slot < this->shardDirectory.size(); slot += size_t(1) << depth)
+			this->shardDirectory[slot] = storage;
+	}
+}
 
+group_storage_t* collection_t::createStorage()
+{
+	// New (empty) storage file with a random name. mutationLock has to be held by the caller
 	std::random_device rndDev;
 	std::mt19937 rng(rndDev());
 
-	// Find one random storage container
-	group_storage_t* storage = nullptr;
-	size_t storageSize = this->storage.size();
-	for (size_t i = 0; i < storageSize; ++i) {
-		storage = this->storage[std::rand() % storageSize];
+	const std::string storagePath = DATA_PATH + "/col_" + this->name + "/storageNew" + std::to_string(rng()) + ".knndb";
+	group_storage_t* storage = new group_storage_t(storagePath, this->cache.get(), this->compressionLevel, &this->mutationLock);
+	std::unique_lock<std::shared_mutex> lockGuard(this->storageListLock);
+	this->storage.push_back(storage);
+	return storage;
+}
+
+group_storage_t* collection_t::placeDocument(size_t id)
+{
+	// Shard which is responsible for the id. A shard which does not exist yet is created with the largest
+	// free part of the directory around the slot of the id (at most 2^minShardDepth shards share the ids)
+	// mutationLock has to be held by the caller
+	std::unique_lock<std::mutex> lockGuard(this->shardLock);
+	const size_t slot = hashDocumentId(id) & (this->shardDirectory.size() - 1);
+	if (this->shardDirectory[slot] != nullptr)
+		return this->shardDirectory[slot];
+
+	size_t depth = this->minShardDepth;
+	for (; depth < this->shardDepth; ++depth) {
+		bool isFree = true;
+		for (size_t other = slot & ((size_t(1) << depth) - 1); other < this->shardDirectory.size(); other += size_t(1) << depth)
+			isFree &= this->shardDirectory[other] == nullptr;
+		if (isFree)
+			break;
+	}
+
+	const size_t bucket = slot & ((size_t(1) << depth) - 1);
+	group_storage_t* storage = this->createStorage();
+	this->shards[storage] = { depth, bucket };
+	for (size_t other = bucket; other < this->shardDirectory.size(); other += size_t(1) << depth)
+		this->shardDirectory[other] = storage;
+	lockGuard.unlock();
+
+	// The next start has to know that it is a shard
+	this->saveMetadata(DATA_PATH);
+	return storage;
+}
+
+bool collection_t::splitShard(group_storage_t* storage)
+{
+	// Give half of the slots of a shard to a new one (the ids whose next hash bit is set). Its documents stay
+	// where they are, the compactor moves them afterwards. mutationLock has to be held by the caller
+	std::unique_lock<std::mutex> lockGuard(this->shardLock);
+	const auto shard = this->shards.find(storage);
+	if (shard == this->shards.end() || shard->second.first >= MAX_SHARD_DEPTH)
+		return false; // No shard or cannot be split anymore
+
+	const auto [depth, bucket] = shard->second;
+	if (depth == this->shardDepth) {
+		// Double the directory: the new half points to the same shards
+		const size_t size = this->shardDirectory.size();
+		this->shardDirectory.resize(size * 2);
+		std::copy(this->shardDirectory.begin(), this->shardDirectory.begin() + size, this->shardDirectory.begin() + size);
+		++this->shardDepth;
+	}
+
+	group_storage_t* sibling = this->createStorage();
+	const size_t siblingBucket = bucket | (size_t(1) << depth);
+	this->shards[storage] = { depth + 1, bucket };
+	this->shards[sibling] = { depth + 1, siblingBucket };
+	for (size_t slot = siblingBucket; slot < this->shardDirectory.size(); slot += size_t(1) << (depth + 1))
+		this->shardDirectory[slot] = sibling;
+	lockGuard.unlock();
+
+	this->saveMetadata(DATA_PATH);
+	return true;
+}
 
-		if(storage->countDocuments() < MAX_ELEMENTS_IN_STORAGE)
-			break; // is not full
+void collection_t::removeStorage(group_storage_t* storage)
+{
+	// Delete a storage (with its files) which has no documents anymore
+	std::unique_lock<std::mutex> lockGuard(this->shardLock);
+	const auto shard = this->shards.find(storage);
+	if (shard != this->shards.end()) {
+		for (size_t slot = shard->second.second; slot < this->shardDirectory.size(); slot += size_t(1) << shard->second.first)
+			this->shardDirectory[slot] = nullptr;
+		this->shards.erase(shard);
 	}
+	lockGuard.unlock();
+
+	std::unique_lock<std::shared_mutex> listGuard(this->storageListLock);
+	this->storage.erase(std::remove(this->storage.begin(), this->storage.end(), storage), this->storage.end());
+	listGuard.unlock();
+	storage->removeFiles();
+	delete storage;
+}
+
+nlohmann::json collection_t::getShard(group_storage_t* storage)
+{
+	// Depth and bucket of a shard (null for storages which are no shards)
+	std::unique_lock<std::mutex> lockGuard(this->shardLock);
+	const auto shard = this->shards.find(storage);
+	if (shard == this->shards.end())
+		return nullptr;
+
+	return { {"depth", shard->second.first}, {"bucket", shard->second.second} };
+}
+
+write_ahead_log_t* collection_t::openLog()
+{
+	// Opens the write-ahead log on first use and replays what is inside. A record is only applied
+	// to storages which did not save it already (their persisted lsn is lower)
+	if (this->wal != nullptr)
+		return this->wal.get();
+
+	uint64_t persistedLsn = 0;
+	for (const auto& storage : this->storage)
+		persistedLsn = std::max(persistedLsn, storage->getPersistedLsn());
+
+	size_t replayed = 0;
+	this->wal = std::make_unique<write_ahead_log_t>(DATA_PATH + "/col_" + this->name + "/collection.wal");
+	this->wal->replay([this, &replayed](uint64_t lsn, const nlohmann::json& record) {
+		const std::string operation = record["op"].get<std::string>();
+
+		if (operation == "insert") {
+			for (const auto& doc : record["documents"]) {
+				const size_t id = doc["id"].get<size_t>();
+
+				// An existing document gets replaced, unless its storage saved this record already. Otherwise
+				// it belongs into a storage which did not save this record (every storage, which did, has
+				// written it down or removed it later). Its shard comes first
+				group_storage_t* existing = this->findStorage(id);
+				if (existing != nullptr) {
+					if (existing->getPersistedLsn() < lsn) {
+						existing->insertDocument(doc, lsn);
+						++replayed;
+					}
+					continue;
+				}
+
+				group_storage_t* shard = this->placeDocument(id);
+				if (shard->getPersistedLsn() < lsn) {
+					shard->insertDocument(doc, lsn);
+					this->registerDocuments(shard, { id });
+					++replayed;
+					continue;
+				}
+
+				for (const auto& storage : this->storage) {
+					if (storage->getPersistedLsn() < lsn) {
+						storage->insertDocument(doc, lsn);
+						this->registerDocuments(storage, { id });
+						++replayed;
+						break;
+					}
+				}
+			}
+			return;
+		}
+
+		for (const auto& id : record["ids"]) {
+			group_storage_t* storage = this->findStorage(id.get<size_t>());
+			if (storage == nullptr || storage->getPersistedLsn() >= lsn)
+				continue; // Does not exist (anymore) or is already inside the storage file
 
-	// Check if Full, all containers are full or less than 10 containers exist
-	if (storage == nullptr || storage->countDocuments() >= MAX_ELEMENTS_IN_STORAGE || this->storage.size() < 10) {
-		// Create new Storage File
-		const std::string storagePath = DATA_PATH + "/col_" + this->name + "/storageNew" + std::to_string(rng()) + ".knndb";
-		storage = new group_storage_t(storagePath);
-		this->storage.push_back(storage);
+			if (operation == "update")
+				storage->editDocument(id.get<size_t>(), record["update"], lsn);
+			else if (operation == "remove") {
+				storage->removeDocument(id.get<size_t>(), lsn);
+				this->unregisterDocuments({ id.get<size_t>() });
+			}
+			++replayed;
+		}
+	}, persistedLsn);
+
+	if (replayed)
+		std::cout << " (replayed " << replayed << " changes from the write-ahead log)";
+	return this->wal.get();
+}
+
+void collection_t::waitForLog(uint64_t lsn, WriteConcern concern, const std::vector<size_t>& ids, size_t effectedDocuments)
+{
+	// Acknowledge the logged change as late as the write concern wants it. The change is in memory already,
+	// so a failed log leaves its outcome unknown (ids and effectedDocuments are what the write would answer)
+	try {
+		if (concern == WriteConcern::Buffered)
+			this->wal->waitWritten(lsn);
+		else if (concern == WriteConcern::Fsync)
+			this->wal->waitDurable(lsn);
 	}
+	catch (const std::runtime_error& ex) {
+		throw write_unknown_t(ex.what(), ids, effectedDocuments);
+	}
+}
 
-	// Enter all Documents
+std::vector<size_t> collection_t::insertDocuments(const std::vector<nlohmann::json> documents, WriteConcern concern)
+{
+	if (!documents.size())
+		return {}; // Emtpy
+
+	std::unique_lock<std::mutex> mutationGuard(this->mutationLock);
+	std::random_device rndDev;
+	std::mt19937 rng(rndDev());
+
+	// Give every Document an id
+	std::vector<nlohmann::json> newDocuments(documents.begin(), documents.end());
 	std::vector<size_t> entereredIds(documents.size());
 	auto enteredIdIT = entereredIds.begin();
-	for (auto doc : documents) {
+	for (auto& doc : newDocuments) {
 		if (!doc.contains("id")) {
 			// Create unused ID
 			bool hasUnusedOne = false;
@@ -176,28 +620,189 @@ std::vector<size_t> collection_t::insertDocuments(const std::vector<nlohmann::js
 				doc["id"] = value;
 
 				// Check if it is used
-				hasUnusedOne = true;
-				for (const auto& item : this->storage) {
-					if (item->savedHere(value)) {
-						hasUnusedOne = false;
-						break;
-					}
-				}
+				hasUnusedOne = this->findStorage(value) == nullptr;
 			}	
 		}
 
-		storage->insertDocument(doc);
 		*enteredIdIT = doc["id"];
 		++enteredIdIT;
 	}
+
+	// Every document goes into the shard of its id (created before the log refers to it). A used id is replaced
+	// inside the storage which contains it, like the replay does (otherwise there would be two copies until
+	// the compactor moves it into its shard)
+	std::vector<group_storage_t*> placedStorages(newDocuments.size());
+	for (size_t i = 0; i < newDocuments.size(); ++i) {
+		placedStorages[i] = this->findStorage(entereredIds[i]);
+		if (placedStorages[i] == nullptr)
+			placedStorages[i] = this->placeDocument(entereredIds[i]);
+	}
+
+	// Documents with a used id replace the stored version (which has to leave the indexes)
+	std::vector<nlohmann::json> oldDocuments = {};
+	if (this->hasIndexes())
+		this->getDocuments(entereredIds, oldDocuments);
+
+	// Log and enter all Documents
+	uint64_t lsn = 0;
+	if (WAL_ACTIVE)
+		lsn = this->openLog()->append({ {"op", "insert"}, {"documents", newDocuments} });
+	else
+		lsn = ++this->generation;
+
+	std::map<group_storage_t*, std::vector<size_t>> storageIds = {};
+	for (size_t i = 0; i < newDocuments.size(); ++i) {
+		placedStorages[i]->insertDocument(newDocuments[i], lsn);
+		storageIds[placedStorages[i]].push_back(entereredIds[i]);
+	}
+	for (const auto& [storage, ids] : storageIds)
+		this->registerDocuments(storage, ids);
+	if (this->hasIndexes())
+		this->updateIndexes(oldDocuments, newDocuments);
+
+	mutationGuard.unlock();
+	if (WAL_ACTIVE)
+		this->waitForLog(lsn, concern, entereredIds, entereredIds.size());
+
 	return entereredIds;
 }
 
+size_t collection_t::updateDocuments(const std::vector<size_t>& ids, const nlohmann::json& update, WriteConcern concern)
+{
+	if (!ids.size())
+		return 0;
+
+	std::unique_lock<std::mutex> mutationGuard(this->mutationLock);
+
+	// The indexes need both versions of every document
+	std::vector<nlohmann::json> oldDocuments = {};
+	std::vector<nlohmann::json> newDocuments = {};
+	if (this->hasIndexes()) {
+		this->getDocuments(ids, oldDocuments);
+		newDocuments.resize(oldDocuments.size());
+		for (size_t i = 0; i < oldDocuments.size(); ++i) {
+			if (!oldDocuments[i].is_null())
+				UPDATE::performUpdate(oldDocuments[i], update, newDocuments[i]);
+		}
+	}
+
+	uint64_t lsn = 0;
+	if (WAL_ACTIVE)
+		lsn = this->openLog()->append({ {"op", "update"}, {"ids", ids}, {"update", update} });
+	else
+		lsn = ++this->generation;
+
+	// Group the ids by their storage
+	std::map<group_storage_t*, std::vector<size_t>> storageIds = {};
+	size_t effectedDocuments = 0;
+	for (const size_t& id : ids) {
+		group_storage_t* storage = this->findStorage(id);
+		if (storage != nullptr) {
+			storageIds[storage].push_back(id);
+			++effectedDocuments;
+		}
+	}
+
+	// Give every storage the command to update its documents
+	auto func = [&update, lsn](group_storage_t* storage, const std::vector<size_t>* storageIds) {
+		for (const size_t& currentId : *storageIds)
+			storage->editDocument(currentId, update, lsn);
+	};
+
+	// Start Worker
+	std::vector<std::thread> worker;
+	for (const auto& [storage, storageIdList] : storageIds)
+		worker.push_back(std::thread(func, storage, &storageIdList));
+
+	// Wait for all to finish
+	for (size_t i = 0; i < worker.size(); ++i)
+	{
+		if (worker[i].joinable())
+			worker[i].join();
+	}
+
+	if (this->hasIndexes())
+		this->updateIndexes(oldDocuments, newDocuments);
+
+	mutationGuard.unlock();
+	if (WAL_ACTIVE)
+		this->waitForLog(lsn, concern, {}, effectedDocuments);
+
+	return effectedDocuments;
+}
+
+size_t collection_t::removeDocuments(const std::vector<size_t>& ids, WriteConcern concern)
+{
+	if (!ids.size())
+		return 0;
+
+	std::unique_lock<std::mutex> mutationGuard(this->mutationLock);
+
+	// The indexes need the removed documents (null = not indexed anymore)
+	std::vector<nlohmann::json> oldDocuments = {};
+	if (this->hasIndexes())
+		this->getDocuments(ids, oldDocuments);
+
+	uint64_t lsn = 0;
+	if (WAL_ACTIVE)
+		lsn = this->openLog()->append({ {"op", "remove"}, {"ids", ids} });
+	else
+		lsn = ++this->generation;
+
+	// Delete them in their storage
+	size_t effectedDocuments = 0;
+	for (const auto& id : ids) {
+		group_storage_t* storage = this->findStorage(id);
+		if (storage != nullptr && storage->removeDocument(id, lsn))
+			++effectedDocuments; // Got removed
+	}
+	this->unregisterDocuments(ids);
+	if (this->hasIndexes())
+		this->updateIndexes(oldDocuments, std::vector<nlohmann::json>(oldDocuments.size(), nullptr));
+
+	mutationGuard.unlock();
+	if (WAL_ACTIVE)
+		this->waitForLog(lsn, concern, {}, effectedDocuments);
+
+	return effectedDocuments;
+}
+
+void collection_t::updateIndexes(const std::vector<nlohmann::json>& oldDocuments, const std::vector<nlohmann::json>& newDocuments)
+{
+	// Hand the changed documents to every index: oldDocuments[i] became newDocuments[i] (null = did not exist).
+	// mutationLock has to be held by the caller, so that no index gets added or swapped in the meantime
+	auto apply = [&oldDocuments, &newDocuments](const std::map<std::string, std::shared_ptr<DbIndex::Iindex_t>>& indexList) {
+		for (const auto& [name, index] : indexList) {
+			for (size_t i = 0; i < oldDocuments.size(); ++i) {
+				if (oldDocuments[i].is_null() && !newDocuments[i].is_null())
+					index->addItem(newDocuments[i]);
+				else if (!oldDocuments[i].is_null() && newDocuments[i].is_null())
+					index->removeItem(oldDocuments[i]);
+				else if (!oldDocuments[i].is_null())
+					index->updateItem(oldDocuments[i], newDocuments[i]);
+			}
+		}
+	};
+	apply(this->indexes);
+
+	// Indexes in building: The storage readers must not add an older version of these documents afterwards
+	if (this->buildingIndexes.size()) {
+		std::unique_lock<std::shared_mutex> lockGuard(this->buildingIndexesLock);
+		for (size_t i = 0; i < oldDocuments.size(); ++i) {
+			const nlohmann::json& document = oldDocuments[i].is_null() ? newDocuments[i] : oldDocuments[i];
+			if (!document.is_null())
+				this->changedWhileBuilding.insert(document["id"].get<size_t>());
+		}
+		apply(this->buildingIndexes);
+	}
+}
+
 std::set<std::tuple<std::string, DbIndex::IndexType, std::shared_ptr<DbIndex::Iindex_t>>> collection_t::getIndexedKeys()
 {
 	std::set<std::tuple<std::string, DbIndex::IndexType, std::shared_ptr<DbIndex::Iindex_t>>> list;
 
 	// Get all Keys from all Indexes
+	std::shared_lock<std::shared_mutex> lockGuard(this->indexesLock);
 	for (const auto& index : this->indexes) {
 		const auto type = index.second->getType();
 
@@ -208,11 +813,17 @@ std::set<std::tuple<std::string, DbIndex::IndexType, std::shared_ptr<DbIndex::Ii
 	return list;
 }
 
-void collection_t::BuildIndexes()
+bool collection_t::addIndex(const std::string& name, std::shared_ptr<DbIndex::Iindex_t> index)
 {
-	if (!this->indexes.size())
-		return; // No Indexes exists
+	// New (empty) index which gets every following change. BuildIndexes adds the existing documents.
+	// Returns false when the name is already used
+	std::unique_lock<std::mutex> mutationGuard(this->mutationLock);
+	std::unique_lock<std::shared_mutex> lockGuard(this->indexesLock);
+	return this->indexes.emplace(name, index).second;
+}
 
+void collection_t::BuildIndexes()
+{
 	// Mark Waiting Stage: If try_lock (or own_lock) returns false, someone else is already waiting
 	// so we can just return
 	std::unique_lock<std::mutex> waitLock(this->indexBuilderWaiting, std::try_to_lock);
@@ -224,26 +835,46 @@ void collection_t::BuildIndexes()
 	std::unique_lock<std::mutex> workLock(this->indexBuilderWorking);
 	waitLock.unlock();
 
-	// Create the Indexes completly new (get Savestring and reload them) in the background and reset them directly
+	// Create the Indexes completly new (get Savestring and reload them) in the background and reset them directly.
+	// From now on every change goes into them as well, so nothing gets lost while the storages are read
+	std::unique_lock<std::mutex> mutationGuard(this->mutationLock);
 	std::map<std::string, std::shared_ptr<DbIndex::Iindex_t>> backgroundIndexes = {};
 	for (const auto& [name, index] : this->indexes) {
+		if (index->createdAt)
+			continue; // Built already (or loaded from its saved graph)
+
 		std::map<std::string, std::shared_ptr<DbIndex::Iindex_t>> m = { { name, index } };
 		auto metadata = DbIndex::saveIndexesToString(m)[0];
 		backgroundIndexes[name] = DbIndex::loadIndexFromJSON(metadata);
 		backgroundIndexes[name]->reset();
 		backgroundIndexes[name]->inBuilding = true;
 	}
+	if (!backgroundIndexes.size())
+		return; // Nothing to build
+
+	// Make room for every document at once (the storage readers add them in parallel)
+	const size_t documentCount = this->countDocuments();
+	for (const auto& [name, index] : backgroundIndexes)
+		index->reserve(documentCount);
+
+	this->buildingIndexes = backgroundIndexes;
+	const std::vector<group_storage_t*> storages = this->storage;
+	mutationGuard.unlock();
+
+	auto workerFunc = [this, &backgroundIndexes](const nlohmann::json& item) {
+		// Add Item to all Indexes (documents which were changed in the meantime are already inside)
+		std::shared_lock<std::shared_mutex> lockGuard(this->buildingIndexesLock);
+		if (this->changedWhileBuilding.count(item["id"].get<size_t>()))
+			return;
 
-	auto workerFunc = [&backgroundIndexes](const nlohmann::json& item) {
-		// Add Item to all Indexes
 		for (const auto& [name, index] : backgroundIndexes)
 			index->addItem(item);
 	};
 
-	// Iterate through storages and process all items (in Threads)
+	// Iterate through storages and process all items (in Threads, large storages are parsed in chunks on the worker pool)
 	std::vector<std::thread> storageWorker = {};
-	for (const auto& storage : this->storage)
-		storageWorker.push_back(std::thread(&group_storage_t::doFuncOnAllDocuments, storage, workerFunc));
+	for (const auto& storage : storages)
+		storageWorker.push_back(std::thread(&group_storage_t::doFuncOnAllDocuments, storage, workerFunc, false));
 
 	// Wait for all to complete
 	for (auto& worker : storageWorker)
@@ -256,22 +887,114 @@ void collection_t::BuildIndexes()
 	}
 
 	// Push background Index to Live
+	mutationGuard.lock();
+	std::unique_lock<std::shared_mutex> lockGuard(this->indexesLock);
 	for (auto& [name, index] : backgroundIndexes)
 		this->indexes[name] = index;
+	this->buildingIndexes.clear();
+	this->changedWhileBuilding.clear();
+}
+
+void collection_t::getDocuments(const std::vector<size_t>& ids, std::vector<nlohmann::json>& documents, std::map<std::string, bool> projection)
+{
+	// Fetch many documents at once: Every touched storage gets all of its ids in one
+	// call (one pass through its file, all storages in parallel). documents[i] belongs
+	// to ids[i] and is null when it does not exist (anymore)
+	documents.assign(ids.size(), nullptr);
+	if (!ids.size())
+		return;
+
+	std::map<group_storage_t*, std::vector<size_t>> storageIds = {};
+	std::unordered_map<size_t, size_t> positions; // 1. id of doc 2. index inside ids
+	positions.reserve(ids.size());
+	for (size_t i = 0; i < ids.size(); ++i) {
+		positions[ids[i]] = i;
+
+		group_storage_t* storage = this->findStorage(ids[i]);
+		if (storage != nullptr)
+			storageIds[storage].push_back(ids[i]);
+	}
+
+	auto func = [&documents, &positions, &projection](group_storage_t* storage, std::vector<size_t>* storageIds) {
+		std::vector<nlohmann::json> found = {};
+		storage->getDocuments(storageIds, found, false, projection);
+
+		// Every worker writes other slots (the id is always inside the projection)
+		for (auto& document : found) {
+			const size_t position = positions.at(document["id"].get<size_t>());
+			documents[position] = std::move(document);
+		}
+	};
+
+	// Start Worker (the last storage is done by this thread)
+	std::vector<std::thread> worker;
+	for (auto it = storageIds.begin(); it != storageIds.end(); ++it) {
+		if (std::next(it) == storageIds.end())
+			func(it->first, &it->second);
+		else
+			worker.push_back(std::thread(func, it->first, &it->second));
+	}
+
+	// Wait for all to finish
+	for (size_t i = 0; i < worker.size(); ++i)
+	{
+		if (worker[i].joinable())
+			worker[i].join();
+	}
+}
+
+group_storage_t* collection_t::findStorage(size_t id)
+{
+	// Storage which contains the document (nullptr when it does not exist)
+	std::shared_lock<std::shared_mutex> lockGuard(this->storageOfIdLock);
+	const auto it = this->storageOfId.find(id);
+	return it != this->storageOfId.end() ? it->second : nullptr;
+}
+
+void collection_t::registerDocuments(group_storage_t* storage, const std::vector<size_t>& ids)
+{
+	std::unique_lock<std::shared_mutex> lockGuard(this->storageOfIdLock);
+	for (const size_t& id : ids)
+		this->storageOfId[id] = storage;
+}
+
+void collection_t::unregisterDocuments(const std::vector<size_t>& ids)
+{
+	std::unique_lock<std::shared_mutex> lockGuard(this->storageOfIdLock);
+	for (const size_t& id : ids)
+		this->storageOfId.erase(id);
 }
 
 size_t collection_t::countDocuments()
 {
 	size_t total = 0;
 
-	for (const auto& storage : this->storage)
+	for (const auto& storage : this->getStorages())
 		total += storage->countDocuments();
 
 	return total;
 }
 
+std::vector<group_storage_t*> collection_t::getStorages()
+{
+	// Copy of the storage list (shards can be created while it is iterated). Storages are only removed while loading
+	std::shared_lock<std::shared_mutex> lockGuard(this->storageListLock);
+	return this->storage;
+}
+
 
 //	*** Indexes ***
+void DbIndex::Iindex_t::updateItem(const nlohmann::json& oldItem, const nlohmann::json& newItem)
+{
+	// Only documents whose indexed values changed have to be indexed again
+	for (const std::string& key : this->getIncludedKeys()) {
+		if (oldItem.contains(key) != newItem.contains(key) || (oldItem.contains(key) && oldItem[key] != newItem[key])) {
+			this->removeItem(oldItem);
+			this->addItem(newItem);
+			return;
+		}
+	}
+}
 
 //	*** KeyValue Index ***
 DbIndex::KeyValueIndex_t::KeyValueIndex_t(std::string keyName, bool isHashedIndex)
@@ -307,7 +1030,27 @@ void DbIndex::KeyValueIndex_t::addItem(const nlohmann::json& item)
 		dataKey = sha256(dataKey.dump());
 
 	std::unique_lock<std::mutex> lockGuard(this->useLock);
-	this->data[dataKey].push_back(item["id"].get<size_t>());
+	this->data[dataKey].insert(item["id"].get<size_t>());
+}
+
+void DbIndex::KeyValueIndex_t::removeItem(const nlohmann::json& item)
+{
+	if (!item.contains(this->perfomedOnKey))
+		return;
+
+	auto dataKey = item[this->perfomedOnKey];
+	if (this->isHashedIndex)
+		dataKey = sha256(dataKey.dump());
+
+	// Remove the id (and the value when no document has it anymore)
+	std::unique_lock<std::mutex> lockGuard(this->useLock);
+	const auto ids = this->data.find(dataKey);
+	if (ids == this->data.end())
+		return;
+
+	ids->second.erase(item["id"].get<size_t>());
+	if (!ids->second.size())
+		this->data.erase(ids);
 }
 
 std::vector<std::vector<size_t>> DbIndex::KeyValueIndex_t::perform(std::vector<std::string>& values)
@@ -323,13 +1066,11 @@ std::vector<std::vector<size_t>> DbIndex::KeyValueIndex_t::perform(std::vector<s
 	// Find for every Value the result and push it to result
 	result.reserve(values.size());
 	for (const std::string& value : values) {
-		if (this->isHashedIndex) {
-			result.push_back(this->data[sha256(value)]);
-		}
-		else {
-			auto obj = nlohmann::json::parse(value);
-			result.push_back(this->data[obj]);
-		}
+		const auto ids = this->isHashedIndex ? this->data.find(sha256(value)) : this->data.find(nlohmann::json::parse(value));
+		if (ids != this->data.end())
+			result.push_back(std::vector<size_t>(ids->second.begin(), ids->second.end()));
+		else
+			result.push_back({});
 	}
 
 	return result;
@@ -395,6 +1136,12 @@ void DbIndex::MultipleKeyValueIndex_t::addItem(const nlohmann::json& item)
 		subIndex->addItem(item);
 }
 
+void DbIndex::MultipleKeyValueIndex_t::removeItem(const nlohmann::json& item)
+{
+	for (const auto& subIndex : this->indexes)
+		subIndex->removeItem(item);
+}
+
 std::vector<size_t> DbIndex::MultipleKeyValueIndex_t::perform(std::map<std::string, std::vector<std::string>>& query) {
 	while (this->inBuilding)
 		std::this_thread::sleep_for(std::chrono::nanoseconds(25));
@@ -458,14 +1205,23 @@ std::set<std::string> DbIndex::MultipleKeyValueIndex_t::getIncludedKeys()
 
 
 //	*** Knn Index ***
-DbIndex::KnnIndex_t::KnnIndex_t(std::string keyName, size_t space)
+DbIndex::KnnIndex_t::KnnIndex_t(std::string keyName, size_t space, std::string metric, size_t M, size_t efConstruction, size_t ef)
 {
 	this->perfomedOnKey = keyName;
-	this->space = hnswlib::L2Space(space);
-	this->index = std::shared_ptr<hnswlib::HierarchicalNSW<float>>(new hnswlib::HierarchicalNSW<float>(&this->space, 0));
+	if (metric == "l2")
+		this->space = std::make_unique<hnswlib::L2Space>(space);
+	else if (metric == "ip" || metric == "cosine")
+		this->space = std::make_unique<hnswlib::InnerProductSpace>(space);
+	else
+		throw std::invalid_argument("metric has to be l2, ip or cosine");
 	this->spaceValue = space;
+	this->metric = metric;
+	this->M = std::max<size_t>(M, 2); // hnswlib needs at least two links per point
+	this->efConstruction = std::max<size_t>(efConstruction, 1);
+	this->ef = std::max<size_t>(ef, 1);
+	this->index = std::shared_ptr<hnswlib::HierarchicalNSW<float>>(new hnswlib::HierarchicalNSW<float>(this->space.get(), 0, this->M, this->efConstruction));
+	this->index->setEf(this->ef);
 	this->createdAt = 0;
-	this->elementCount = 0;
 }
 
 std::vector<std::vector<size_t>> DbIndex::KnnIndex_t::perform(std::vector<std::vector<float>>& query, size_t limit)
@@ -496,10 +1252,11 @@ std::vector<std::vector<size_t>> DbIndex::KnnIndex_t::perform(std::vector<std::v
 
 void DbIndex::KnnIndex_t::reset()
 {
-	std::unique_lock<std::mutex> lockGuard(this->useLock);
+	std::unique_lock<std::shared_mutex> lockGuard(this->graphLock);
 
-	// Default 3 elements
-	std::shared_ptr<hnswlib::HierarchicalNSW<float>>(new hnswlib::HierarchicalNSW<float>(&this->space, 3));
+	// Empty graph (grows with the first items)
+	this->index = std::shared_ptr<hnswlib::HierarchicalNSW<float>>(new hnswlib::HierarchicalNSW<float>(this->space.get(), 0, this->M, this->efConstruction));
+	this->index->setEf(this->ef);
 }
 
 void DbIndex::KnnIndex_t::finish()
@@ -542,24 +1299,115 @@ void DbIndex::KnnIndex_t::addItem(const nlohmann::json& item)
 		*it = 0;
 		++it;
 	}
+	this->preparePoint(data);
 
-	std::unique_lock<std::mutex> lockGuard(this->useLock);
+	// Add Datapoint (a known id gets the new vector and is not deleted anymore). hnswlib locks the points it
+	// connects, so the storage readers of a build add in parallel. A full graph gets doubled exclusively
+	hnswlib::labeltype _id = document["id"].get<size_t>();
+	while (true) {
+		std::shared_lock<std::shared_mutex> addGuard(this->graphLock);
+		try {
+			const hnswlib::tableint internalId = this->index->addPoint(data.data(), _id, -1);
+			if (this->index->isMarkedDeleted(internalId))
+				this->index->unmarkDeletedInternal(internalId);
+			return;
+		}
+		catch (const std::runtime_error& ex) {
+			const size_t fullSize = this->index->max_elements_;
+			addGuard.unlock();
 
-	// Add one more to index
-	this->elementCount += 1;
-	static_cast<hnswlib::HierarchicalNSW<float>*>(this->index.get())->resizeIndex(this->elementCount);
+			std::unique_lock<std::shared_mutex> growGuard(this->graphLock);
+			if (this->index->max_elements_ != fullSize)
+				continue; // Another one grew it already
+			if (this->index->cur_element_count < fullSize)
+				throw; // Not because it is full
 
-	// Add Datapoint when it is locked
-	hnswlib::labeltype _id = document["id"].get<size_t>();
-	this->index->addPoint(data.data(), _id);
+			this->index->resizeIndex(std::max<size_t>(16, fullSize * 2));
+		}
+	}
 }
 
-void DbIndex::KnnIndex_t::perform(const std::vector<float>& query, std::priority_queue<std::pair<float, hnswlib::labeltype>>* result, size_t limit) {
+void DbIndex::KnnIndex_t::removeItem(const nlohmann::json& item)
+{
+	// The point stays inside the graph (to keep it connected), but is not found anymore
+	std::unique_lock<std::shared_mutex> lockGuard(this->graphLock);
+	try {
+		this->index->markDelete(item["id"].get<size_t>());
+	}
+	catch (const std::runtime_error& ex) {} // Was not indexed
+}
+
+void DbIndex::KnnIndex_t::preparePoint(std::vector<float>& point)
+{
+	// Every point (documents and queries) gets the dimension of the index. Cosine compares unit vectors
+	// with the inner product (the zero vector stays as it is)
+	point.resize(this->spaceValue, 0);
+	if (this->metric != "cosine")
+		return;
+
+	float norm = 0;
+	for (const float value : point)
+		norm += value * value;
+	if (norm <= 0)
+		return;
+
+	norm = std::sqrt(norm);
+	for (float& value : point)
+		value /= norm;
+}
+
+void DbIndex::KnnIndex_t::reserve(size_t documents)
+{
+	// One allocation for a build instead of doubling the graph while it gets filled
+	std::unique_lock<std::shared_mutex> lockGuard(this->graphLock);
+	if (documents > this->index->max_elements_)
+		this->index->resizeIndex(documents);
+}
+
+void DbIndex::KnnIndex_t::perform(const std::vector<float>& query, std::priority_queue<std::pair<float, hnswlib::labeltype>>* result, size_t limit, size_t ef) {
 	while (this->inBuilding)
 		std::this_thread::sleep_for(std::chrono::nanoseconds(25));
-	std::unique_lock<std::mutex> lockGuard(this->useLock);
+	std::unique_lock<std::shared_mutex> lockGuard(this->graphLock);
+
+	std::vector<float> point = query;
+	this->preparePoint(point);
+
+	// Searches are exclusive, so the ef of this query can be set on the graph
+	this->index->setEf(ef ? ef : this->ef);
+	*result = this->index->searchKnn(point.data(), limit);
+}
 
-	*result = this->index->searchKnn(query.data(), limit);
+std::string DbIndex::KnnIndex_t::saveGraph()
+{
+	std::ostringstream graph;
+	this->index->saveIndex(graph);
+	return graph.str();
+}
+
+bool DbIndex::KnnIndex_t::loadGraph(const std::string& path)
+{
+	// Take over a saved graph (false when it is damaged, belongs to another space or consists mostly of deleted
+	// points, which only make it slower and less connected)
+	std::shared_ptr<hnswlib::HierarchicalNSW<float>> graph = nullptr;
+	try {
+		graph = std::shared_ptr<hnswlib::HierarchicalNSW<float>>(new hnswlib::HierarchicalNSW<float>(this->space.get(), path));
+	}
+	catch (const std::exception& ex) {
+		return false;
+	}
+	if (graph->size_data_per_element_ != graph->size_links_level0_ + graph->data_size_ + sizeof(hnswlib::labeltype))
+		return false;
+
+	size_t deletedPoints = 0;
+	for (hnswlib::tableint i = 0; i < graph->cur_element_count; ++i)
+		deletedPoints += graph->isMarkedDeleted(i);
+	if (deletedPoints > graph->cur_element_count * MAX_GRAPH_DELETIONS)
+		return false;
+
+	std::unique_lock<std::shared_mutex> lockGuard(this->graphLock);
+	this->index = graph;
+	this->index->setEf(this->ef);
+	return true;
 }
 
 nlohmann::json DbIndex::KnnIndex_t::saveMetadata()
@@ -569,6 +1417,10 @@ nlohmann::json DbIndex::KnnIndex_t::saveMetadata()
 	metadata["type"] = DbIndex::IndexType::KnnIndex;
 	metadata["keyName"] = this->perfomedOnKey;
 	metadata["space"] = this->spaceValue;
+	metadata["metric"] = this->metric;
+	metadata["M"] = this->M;
+	metadata["efConstruction"] = this->efConstruction;
+	metadata["ef"] = this->ef;
 
 	return metadata;
 }
@@ -609,13 +1461,52 @@ void DbIndex::RangeIndex_t::addItem(const nlohmann::json& item)
 	try {
 		auto value = item[this->perfomedOnKey];
 
+		const size_t id = item["id"].get<size_t>();
+		float key = 0;
+		if (value.is_number())
+			key = value.get<float>();
+		else if (value.is_string())
+			key = std::stof(value.get<std::string>());
+		else
+			return;
+
+		// Every document is inside only once
 		std::unique_lock<std::mutex> lockGuard(this->useLock);
+		const auto [first, last] = this->data.equal_range(key);
+		for (auto it = first; it != last; ++it) {
+			if (it->second == id)
+				return;
+		}
+		this->data.insert(std::make_pair(key, id));
+	}
+	catch (const std::exception& ex) {} // Not a number
+}
+
+void DbIndex::RangeIndex_t::removeItem(const nlohmann::json& item)
+{
+	if (!item.contains(this->perfomedOnKey))
+		return;
+
+	try {
+		auto value = item[this->perfomedOnKey];
+		float key = 0;
 		if (value.is_number())
-			this->data.insert(std::make_pair(value.get<float>(), item["id"].get<size_t>()));
+			key = value.get<float>();
 		else if (value.is_string())
-			this->data.insert(std::make_pair(std::stof(value.get<std::string>()), item["id"].get<size_t>()));
+			key = std::stof(value.get<std::string>());
+		else
+			return;
+
+		std::unique_lock<std::mutex> lockGuard(this->useLock);
+		const auto [first, last] = this->data.equal_range(key);
+		for (auto it = first; it != last; ++it) {
+			if (it->second == item["id"].get<size_t>()) {
+				this->data.erase(it);
+				return;
+			}
+		}
 	}
-	catch (int code) {}
+	catch (const std::exception& ex) {} // Not a number
 }
 
 void DbIndex::RangeIndex_t::perform(float lowerBound, float higherBound, std::vector<size_t>& results)
@@ -623,6 +1514,8 @@ void DbIndex::RangeIndex_t::perform(float lowerBound, float higherBound, std::ve
 	while (this->inBuilding)
 		std::this_thread::sleep_for(std::chrono::nanoseconds(25));
 	std::unique_lock<std::mutex> lockGuard(this->useLock);
+	if (lowerBound > higherBound)
+		return; // Empty range
 
 	auto itLower = this->data.lower_bound(lowerBound);
 	auto itHigher = this->data.upper_bound(higherBound);
@@ -662,7 +1555,8 @@ std::shared_ptr<DbIndex::Iindex_t> DbIndex::loadIndexFromJSON(const nlohmann::js
 		break;
 	case DbIndex::IndexType::KnnIndex:
 		index = std::shared_ptr<DbIndex::Iindex_t>(
-			new DbIndex::KnnIndex_t(metadata["keyName"].get<std::string>(), metadata["space"].get<size_t>())
+			new DbIndex::KnnIndex_t(metadata["keyName"].get<std::string>(), metadata["space"].get<size_t>(), metadata.value("metric", std::string("l2")),
+				metadata.value("M", size_t(16)), metadata.value("efConstruction", size_t(200)), metadata.value("ef", size_t(10)))
 		);
 		break;
 	case DbIndex::IndexType::RangeIndex:
@@ -691,14 +1585,14 @@ std::vector<nlohmann::json> DbIndex::saveIndexesToString(std::map<std::string, s
 
 
 namespace CollectionFunctions {
-	void performTTLCheck(const collection_t* col) {
+	void performTTLCheck(collection_t* col) {
 		// Iterate through every storage and document to check wheter the &ttl field exists
 		
 		auto nowTimeSeconds = std::chrono::duration_cast<std::chrono::seconds>(
 			std::chrono::system_clock::now().time_since_epoch() // Since 1970
 		).count();
 
-		for (const auto& storage : col->storage) {
+		for (const auto& storage : col->getStorages()) {
 			std::vector<size_t> ttlExpired = {}; // document ids
 
 			// Check all documents
@@ -716,11 +1610,10 @@ namespace CollectionFunctions {
 
 				if (diff > 0) // Expired
 					ttlExpired.push_back(document["id"].get<size_t>());
-			});
+			}, true);
 
 			// Remove expired ones
-			for (const size_t& id : ttlExpired)
-				storage->removeDocument(id);
+			col->removeDocuments(ttlExpired);
 
 			if (ttlExpired.size()) // Save if something happend
 				storage->save();
@@ -728,11 +1621,137 @@ namespace CollectionFunctions {
 	}
 
 
+	void throttleCompaction(std::streamoff writtenBytes) {
+		// Sleep as long as writing these bytes may take with COMPACTION_RATE (bytes / (MB/s) ==> microseconds),
+		// so that the compactor leaves enough I/O for the requests
+		if (COMPACTION_RATE && writtenBytes > 0)
+			std::this_thread::sleep_for(std::chrono::microseconds(writtenBytes / std::streamoff(COMPACTION_RATE)));
+	}
+
+	void performCompaction(collection_t* col) {
+		// Rewrite storage files which consist of too many holes or are written differently
+		// than configured (encoding, compression)
+		for (const auto& storage : col->getStorages()) {
+			if (INTERRUPT)
+				return;
+
+			if (storage->getFragmentation() >= COMPACTION_FRAGMENTATION || storage->isOutdated())
+				throttleCompaction(storage->compact());
+		}
+	}
+
+	void moveMisplacedDocuments(collection_t* col) {
+		// Move every document which is not inside the shard of its id (documents of split shards, of storages
+		// from before the hash placement and of crashes in the middle of a move) in batches
+		const std::vector<group_storage_t*> storages = col->getStorages();
+		for (const auto& source : storages) {
+			std::unique_lock<std::mutex> mutationGuard(col->mutationLock);
+			std::map<group_storage_t*, std::vector<size_t>> targetIds = {};
+			std::vector<size_t> leftovers = {};
+
+			for (const size_t& id : source->getAllIds()) {
+				if (col->findStorage(id) != source)
+					leftovers.push_back(id); // Copy of a move which was not saved completely
+				else if (col->placeDocument(id) != source)
+					targetIds[col->placeDocument(id)].push_back(id);
+			}
+
+			for (const size_t& id : leftovers)
+				source->removeDocument(id, source->getPendingLsn());
+			mutationGuard.unlock();
+
+			for (const auto& [target, ids] : targetIds) {
+				for (size_t begin = 0; begin < ids.size() && !INTERRUPT; begin += SHARD_MOVE_BATCH) {
+					std::vector<size_t> batch(ids.begin() + begin, ids.begin() + std::min(ids.size(), begin + SHARD_MOVE_BATCH));
+
+					// No changes in between, so that the write-ahead log stays in the same order as the storages
+					// (the writers of both storages come first)
+					std::unique_lock<std::mutex> targetWriter = target->lockWriter(true);
+					std::unique_lock<std::mutex> sourceWriter = source->lockWriter(true);
+					std::lock(targetWriter, sourceWriter);
+					mutationGuard.lock();
+					std::vector<nlohmann::json> documents = {};
+					source->getDocuments(&batch, documents);
+
+					// Both storages contain every logged change to these documents ==> take over the newest
+					// sequence number. Write them down at their new place first, then remove them
+					const uint64_t lsn = std::max(source->getPendingLsn(), target->getPendingLsn());
+					std::vector<size_t> movedIds = {};
+					for (const auto& document : documents) {
+						target->insertDocument(document, lsn);
+						movedIds.push_back(document["id"].get<size_t>());
+					}
+					col->registerDocuments(target, movedIds);
+
+					for (const size_t& id : movedIds)
+						source->removeDocument(id, lsn);
+					target->takeSnapshot();
+					source->takeSnapshot();
+					mutationGuard.unlock();
+
+					target->writeSnapshot();
+					source->writeSnapshot();
+					targetWriter.unlock();
+					sourceWriter.unlock();
+
+					throttleCompaction(target->getStatistics()["bytes"].get<std::streamoff>());
+				}
+			}
+		}
+	}
+
+	void performSharding(collection_t* col) {
+		// Split the shards which passed MAX_ELEMENTS_IN_STORAGE and move the documents after them
+		// (again, as long as some are still too big)
+		bool splitted = true;
+		while (splitted && !INTERRUPT) {
+			splitted = false;
+
+			std::unique_lock<std::mutex> mutationGuard(col->mutationLock);
+			const std::vector<group_storage_t*> storages = col->storage;
+			for (const auto& storage : storages) {
+				if (storage->countDocuments() > MAX_ELEMENTS_IN_STORAGE)
+					splitted |= col->splitShard(storage);
+			}
+			mutationGuard.unlock();
+
+			moveMisplacedDocuments(col);
+		}
+	}
+
+	nlohmann::json getStatistics(collection_t* col) {
+		// Fragmentation of every storage file and of the whole collection
+		nlohmann::json storages = nlohmann::json::array();
+		size_t rows = 0, holes = 0;
+
+		for (const auto& storage : col->getStorages()) {
+			nlohmann::json statistics = storage->getStatistics();
+			statistics["shard"] = col->getShard(storage);
+			rows += statistics["rows"].get<size_t>();
+			holes += statistics["holes"].get<size_t>();
+			storages.push_back(statistics);
+		}
+
+		return {
+			{"name", col->name},
+			{"compressionLevel", col->compressionLevel},
+			{"documents", col->countDocuments()},
+			{"rows", rows},
+			{"holes", holes},
+			{"fragmentation", rows ? float(holes) / float(rows) : 0.0f},
+			{"storages", storages},
+			{"cache", col->cache != nullptr ? col->cache->getStatistics() : nlohmann::json(nullptr)}
+		};
+	}
+
 	void runCircle() {
 		while (!INTERRUPT) {
-			// Do TTL Check
-			for (const auto& item : collections)
+			// Do TTL Check, bring the documents into their shards and compact what got fragmented
+			for (const auto& item : collections) {
 				performTTLCheck(item.second);
+				performSharding(item.second);
+				performCompaction(item.second);
+			}
 
 			std::this_thread::sleep_for(std::chrono::minutes(5));
 		}
@@ -6,13 +6,19 @@
 #include <map>
 #include <set>
 #include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
 #include <thread>
 #include <chrono>
+#include <stdexcept>
 
 #include <nlohmann/json.hpp>
 
 #include "hnswlib.h"
 #include "storage.h"
+#include "wal.h"
+#include "cache.h"
 
 
 namespace DbIndex {
@@ -33,8 +39,10 @@ namespace DbIndex {
 
 		virtual void reset() = 0;
 		virtual void finish() = 0;
-		virtual void addItem(const nlohmann::json& item) = 0;
-
+		virtual void addItem(const nlohmann::json& item) = 0; // adding a document twice changes nothing
+		virtual void removeItem(const nlohmann::json& item) = 0; // item is the document as it was indexed
+		virtual void updateItem(const nlohmann::json& oldItem, const nlohmann::json& newItem); // re-indexes when an included key changed
+		virtual void reserve(size_t) {} // room for the documents of a build (before they get added)
 
 		virtual std::set<std::string> getIncludedKeys() = 0;
 		virtual nlohmann::json saveMetadata() = 0;
@@ -44,7 +52,7 @@ namespace DbIndex {
 	class KeyValueIndex_t : public Iindex_t {
 	private:
 		bool isHashedIndex;
-		std::map<nlohmann::json, std::vector<size_t>> data; // 1. hash of value 2. id of documents
+		std::map<nlohmann::json, std::set<size_t>> data; // 1. hash of value 2. id of documents
 	
 	public:
 		std::string perfomedOnKey;
@@ -55,6 +63,7 @@ namespace DbIndex {
 		inline void reset();
 		inline void finish();
 		inline void addItem(const nlohmann::json& item);
+		void removeItem(const nlohmann::json& item);
 		std::vector<std::vector<size_t>> perform(std::vector<std::string>& values);
 
 		nlohmann::json saveMetadata();
@@ -76,6 +85,7 @@ namespace DbIndex {
 		inline void reset();
 		inline void finish();
 		inline void addItem(const nlohmann::json& item);
+		void removeItem(const nlohmann::json& item);
 
 		std::vector<size_t> perform(std::map<std::string, std::vector<std::string>>& query);
 
@@ -86,22 +96,33 @@ namespace DbIndex {
 
 	class KnnIndex_t : public Iindex_t {
 	private:
-		std::shared_ptr<hnswlib::AlgorithmInterface<float>> index = nullptr;
-		hnswlib::L2Space space = hnswlib::L2Space(0);
+		std::shared_ptr<hnswlib::HierarchicalNSW<float>> index = nullptr; // removed documents are only marked as deleted
+		std::unique_ptr<hnswlib::SpaceInterface<float>> space = nullptr; // distance of the metric
 		size_t spaceValue = 0;
-		std::atomic<size_t> elementCount = 0;
+		std::string metric = "l2"; // l2, ip (inner product) or cosine (normalized vectors with the inner product)
+		size_t M = 16; // links per point (more: better recall, more memory and slower adding)
+		size_t efConstruction = 200; // candidates while a point gets connected
+		size_t ef = 10; // candidates of a search (at least k)
 		std::string perfomedOnKey = "";
 
 	public:
-		KnnIndex_t(std::string keyName, size_t space);
+		uint64_t savedGeneration = 0; // generation of the documents inside the saved graph file (0 = not saved)
+		std::shared_mutex graphLock; // instead of useLock: points are added in parallel (shared), everything else is exclusive
+
+		KnnIndex_t(std::string keyName, size_t space, std::string metric = "l2", size_t M = 16, size_t efConstruction = 200, size_t ef = 10);
 		~KnnIndex_t() {};
 
 		std::vector<std::vector<size_t>> perform(std::vector<std::vector<float>>& query, size_t limit);
 		void reset();
 		inline void finish();
 		inline void addItem(const nlohmann::json& item);
+		void removeItem(const nlohmann::json& item);
+		void reserve(size_t documents);
+		void preparePoint(std::vector<float>& point);
 
-		void perform(const std::vector<float>&, std::priority_queue<std::pair<float, hnswlib::labeltype>>*, size_t limit);
+		void perform(const std::vector<float>&, std::priority_queue<std::pair<float, hnswlib::labeltype>>*, size_t limit, size_t ef = 0); // ef 0 = the one of the index
+		std::string saveGraph(); // contents of the graph file (for loadGraph), graphLock has to be held
+		bool loadGraph(const std::string& path);
 
 		nlohmann::json saveMetadata();
 		std::set<std::string> getIncludedKeys();
@@ -119,6 +140,7 @@ namespace DbIndex {
 		inline void reset();
 		inline void finish();
 		inline void addItem(const nlohmann::json& item);
+		void removeItem(const nlohmann::json& item);
 
 		void perform(float lowerBound, float higherBound, std::vector<size_t>& results);
 
@@ -132,28 +154,90 @@ namespace DbIndex {
 }
 
 
+// When a write gets acknowledged: right after it was applied in memory, after it was handed over
+// to the OS (write-ahead log) or after it was fsynced (write-ahead log group commit or save)
+enum class WriteConcern {
+	None,
+	Buffered,
+	Fsync
+};
+
+bool readWriteConcern(const nlohmann::json& request, WriteConcern& concern); // "writeConcern" of a request (false when it is invalid)
+
+// The write is applied in memory, but its write concern was not met (the write-ahead log or the save failed).
+// Nobody knows whether it survives a restart, so the answer carries the ids and the count nevertheless
+class write_unknown_t : public std::runtime_error {
+public:
+	std::vector<size_t> ids;
+	size_t effectedDocuments;
+
+	write_unknown_t(const std::string& message, const std::vector<size_t>& ids, size_t effectedDocuments)
+		: std::runtime_error(message), ids(ids), effectedDocuments(effectedDocuments) {}
+};
+
 class collection_t {
 private:
 	std::mutex indexBuilderWaiting;
 	std::mutex indexBuilderWorking;
+	std::unordered_map<size_t, group_storage_t*> storageOfId; // 1. id of doc 2. storage which contains it
+	std::shared_mutex storageOfIdLock;
+	std::vector<group_storage_t*> shardDirectory; // index: lowest shardDepth bits of the hashed id (nullptr = shard not created yet)
+	std::unordered_map<group_storage_t*, std::pair<size_t, size_t>> shards; // 1. storage 2. depth and bucket (lowest depth bits of the hashed ids inside)
+	size_t shardDepth = 0; // bits of the hashed id which select the directory slot
+	std::mutex shardLock;
+
+	std::map<std::string, std::shared_ptr<DbIndex::Iindex_t>> buildingIndexes; // rebuilt by BuildIndexes (they get every change as well)
+	std::unordered_set<size_t> changedWhileBuilding; // ids which are inside buildingIndexes in their newest version already
+	std::shared_mutex buildingIndexesLock; // writers (unique) and the storage readers of BuildIndexes (shared)
+
+	group_storage_t* createStorage();
+	void waitForLog(uint64_t lsn, WriteConcern concern, const std::vector<size_t>& ids, size_t effectedDocuments);
+	bool hasIndexes() { return this->indexes.size() || this->buildingIndexes.size(); }; // mutationLock has to be held
+	void updateIndexes(const std::vector<nlohmann::json>& oldDocuments, const std::vector<nlohmann::json>& newDocuments);
 
 public:
 	std::string name;
-	std::vector<group_storage_t*> storage;
-	std::map<std::string, std::shared_ptr<DbIndex::Iindex_t>> indexes;
+	std::vector<group_storage_t*> storage; // changed with mutationLock and storageListLock
+	std::shared_mutex storageListLock; // readers without the mutationLock (they work on a copy, see getStorages)
+	std::map<std::string, std::shared_ptr<DbIndex::Iindex_t>> indexes; // changed with mutationLock and indexesLock
+	std::shared_mutex indexesLock; // readers without the mutationLock
 	std::mutex saveLock;
+	std::string savedMetadata = ""; // content of collection.metadata (unchanged metadata is not written again)
+	std::mutex mutationLock; // keeps the write-ahead log in the same order as the changes in memory
+	std::unique_ptr<write_ahead_log_t> wal = nullptr;
+	std::unique_ptr<document_cache_t> cache = nullptr; // parsed documents of all storages (DOCUMENT_CACHE_SIZE)
+	int compressionLevel = 0; // zlib level of the storage files (0 = uncompressed)
+	uint64_t generation = 0; // sequence number of the last change without write-ahead log (it stands in for the lsn)
+	size_t minShardDepth = 0; // the collection starts with 2^minShardDepth shards
 
 	collection_t(std::string);
-	std::vector<size_t> insertDocuments(const std::vector<nlohmann::json> documents);
+	void saveMetadata(std::string dataPath);
+	void setCompressionLevel(int compressionLevel);
+	void loadShards(const nlohmann::json& metadata);
+	group_storage_t* placeDocument(size_t id);
+	bool splitShard(group_storage_t* storage);
+	void removeStorage(group_storage_t* storage);
+	nlohmann::json getShard(group_storage_t* storage);
+	write_ahead_log_t* openLog();
+	std::vector<size_t> insertDocuments(const std::vector<nlohmann::json> documents, WriteConcern concern = WriteConcern::Fsync);
+	size_t updateDocuments(const std::vector<size_t>& ids, const nlohmann::json& update, WriteConcern concern = WriteConcern::Fsync);
+	size_t removeDocuments(const std::vector<size_t>& ids, WriteConcern concern = WriteConcern::Fsync);
+	void getDocuments(const std::vector<size_t>& ids, std::vector<nlohmann::json>& documents, std::map<std::string, bool> projection = {});
+	group_storage_t* findStorage(size_t id);
+	void registerDocuments(group_storage_t* storage, const std::vector<size_t>& ids);
+	void unregisterDocuments(const std::vector<size_t>& ids);
 	std::set<std::tuple<std::string, DbIndex::IndexType, std::shared_ptr<DbIndex::Iindex_t>>> getIndexedKeys();
-	void BuildIndexes();
+	bool addIndex(const std::string& name, std::shared_ptr<DbIndex::Iindex_t> index);
+	void BuildIndexes(); // builds the indexes which are not built yet from the storage files (changes keep them up to date on their own)
 
 	size_t countDocuments();
+	std::vector<group_storage_t*> getStorages();
 };
 
 void loadDatabase(std::string);
 void loadCollection(std::string);
 
+void saveCollection(collection_t* col, std::string dataPath, bool withGraphs = false); // withGraphs: write the KNN graphs as well
 void saveDatabase(std::string dataPath);
 
 inline std::map<std::string, collection_t*> collections = {};
@@ -161,7 +245,12 @@ inline std::map<std::string, collection_t*> collections = {};
 namespace CollectionFunctions {
 	inline std::thread managerThread;
 
-	void performTTLCheck(const collection_t* col);
+	void performTTLCheck(collection_t* col);
+	void throttleCompaction(std::streamoff writtenBytes);
+	void performCompaction(collection_t* col);
+	void moveMisplacedDocuments(collection_t* col);
+	void performSharding(collection_t* col);
+	nlohmann::json getStatistics(collection_t* col);
 
 	void runCircle();
 	void StartManagerThread();
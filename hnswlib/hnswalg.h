@@ -600,7 +600,11 @@ namespace hnswlib {
 
         void saveIndex(const std::string &location) {
             std::ofstream output(location, std::ios::binary);
-            std::streampos position;
+            saveIndex(output);
+            output.close();
+        }
+
+        void saveIndex(std::ostream &output) {
 
             writeBinaryPOD(output, offsetLevel0_);
             writeBinaryPOD(output, max_elements_);
@@ -625,7 +629,6 @@ namespace hnswlib {
                 if (linkListSize)
                     output.write(linkLists_[i], linkListSize);
             }
-            output.close();
         }
 
         void loadIndex(const std::string &location, SpaceInterface<dist_t> *s, size_t max_elements_i=0) {
@@ -0,0 +1,202 @@
+#include <stdexcept>
+#include <algorithm>
+
+#include "idmap.h"
+
+// Slots are only used up to this share, so probe sequences stay short
+const size_t ID_MAP_LOAD_PERCENT = 70;
+const size_t ID_MAP_MIN_CAPACITY = 16;
+
+size_t id_map_t::slotOf(uint64_t id) const
+{
+	// splitmix64 finalizer (ids are mostly ascending numbers, which would cluster otherwise)
+	id ^= id >> 30;
+	id *= 0xBF58476D1CE4E5B9ULL;
+	id ^= id >> 27;
+	id *= 0x94D049BB133111EBULL;
+	id ^= id >> 31;
+	return size_t(id) & (this->ids.size() - 1);
+}
+
+void id_map_t::grow(size_t capacity)
+{
+	// Capacity is always a power of two (the slot is masked out of the hash)
+	size_t newCapacity = ID_MAP_MIN_CAPACITY;
+	while (newCapacity * ID_MAP_LOAD_PERCENT / 100 < capacity)
+		newCapacity *= 2;
+	if (newCapacity <= this->ids.size())
+		return;
+
+	std::vector<uint64_t> oldIds(newCapacity, EMPTY_SLOT);
+	std::vector<uint32_t> oldRows(newCapacity, 0);
+	oldIds.swap(this->ids);
+	oldRows.swap(this->rows);
+
+	for (size_t slot = 0; slot < oldIds.size(); ++slot) {
+		if (oldIds[slot] == EMPTY_SLOT)
+			continue;
+
+		size_t newSlot = this->slotOf(oldIds[slot]);
+		while (this->ids[newSlot] != EMPTY_SLOT)
+			newSlot = (newSlot + 1) & (this->ids.size() - 1);
+		this->ids[newSlot] = oldIds[slot];
+		this->rows[newSlot] = oldRows[slot];
+	}
+}
+
+bool id_map_t::get(size_t id, size_t& row) const
+{
+	if (id == EMPTY_SLOT) {
+		row = this->maxIdRow;
+		return this->hasMaxId;
+	}
+	if (!this->ids.size())
+		return false;
+
+	for (size_t slot = this->slotOf(id); this->ids[slot] != EMPTY_SLOT; slot = (slot + 1) & (this->ids.size() - 1)) {
+		if (this->ids[slot] == id) {
+			row = this->rows[slot];
+			return true;
+		}
+	}
+
+	return false;
+}
+
+size_t id_map_t::at(size_t id) const
+{
+	size_t row = 0;
+	if (!this->get(id, row))
+		throw std::out_of_range("id_map_t: id is not inside");
+	return row;
+}
+
+bool id_map_t::contains(size_t id) const
+{
+	size_t row = 0;
+	return this->get(id, row);
+}
+
+void id_map_t::set(size_t id, size_t row)
+{
+	if (row > UINT32_MAX)
+		throw std::length_error("id_map_t: row index does not fit into 32 bits");
+
+	if (id == EMPTY_SLOT) {
+		this->count += this->hasMaxId ? 0 : 1;
+		this->hasMaxId = true;
+		this->maxIdRow = uint32_t(row);
+		return;
+	}
+
+	this->grow(this->count + 1);
+	size_t slot = this->slotOf(id);
+	while (this->ids[slot] != EMPTY_SLOT && this->ids[slot] != id)
+		slot = (slot + 1) & (this->ids.size() - 1);
+
+	if (this->ids[slot] == EMPTY_SLOT)
+		++this->count;
+	this->ids[slot] = id;
+	this->rows[slot] = uint32_t(row);
+}
+
+bool id_map_t::erase(size_t id)
+{
+	if (id == EMPTY_SLOT) {
+		const bool existed = this->hasMaxId;
+		this->count -= existed ? 1 : 0;
+		this->hasMaxId = false;
+		return existed;
+	}
+	if (!this->ids.size())
+		return false;
+
+	const size_t mask = this->ids.size() - 1;
+	size_t slot = this->slotOf(id);
+	while (this->ids[slot] != id) {
+		if (this->ids[slot] == EMPTY_SLOT)
+			return false;
+		slot = (slot + 1) & mask;
+	}
+
+	// Backward shift: move following entries of the probe sequence into the gap, so that no
+	// lookup stops too early at it (there are no tombstones)
+	size_t gap = slot;
+	for (size_t next = (gap + 1) & mask; this->ids[next] != EMPTY_SLOT; next = (next + 1) & mask) {
+		const size_t home = this->slotOf(this->ids[next]);
+		if (((next - home) & mask) >= ((next - gap) & mask)) {
+			this->ids[gap] = this->ids[next];
+			this->rows[gap] = this->rows[next];
+			gap = next;
+		}
+	}
+
+	this->ids[gap] = EMPTY_SLOT;
+	--this->count;
+	return true;
+}
+
+void id_map_t::reserve(size_t documents)
+{
+	this->grow(documents);
+}
+
+void id_map_t::clear()
+{
+	// Also gives the memory back
+	std::vector<uint64_t>().swap(this->ids);
+	std::vector<uint32_t>().swap(this->rows);
+	this->count = 0;
+	this->hasMaxId = false;
+}
+
+void id_map_t::swap(id_map_t& other)
+{
+	this->ids.swap(other.ids);
+	this->rows.swap(other.rows);
+	std::swap(this->count, other.count);
+	std::swap(this->hasMaxId, other.hasMaxId);
+	std::swap(this->maxIdRow, other.maxIdRow);
+}
+
+size_t id_map_t::memoryUsage() const
+{
+	return this->ids.capacity() * sizeof(uint64_t) + this->rows.capacity() * sizeof(uint32_t);
+}
+
+id_map_t::const_iterator id_map_t::begin() const
+{
+	return const_iterator(this, 0);
+}
+
+id_map_t::const_iterator id_map_t::end() const
+{
+	return const_iterator(this, this->ids.size() + 1);
+}
+
+id_map_t::const_iterator::const_iterator(const id_map_t* map, size_t slot) : map(map), slot(slot)
+{
+	this->skipEmpty();
+}
+
+void id_map_t::const_iterator::skipEmpty()
+{
+	while (this->slot < this->map->ids.size() && this->map->ids[this->slot] == EMPTY_SLOT)
+		++this->slot;
+	if (this->slot == this->map->ids.size() && !this->map->hasMaxId)
+		++this->slot;
+}
+
+std::pair<size_t, size_t> id_map_t::const_iterator::operator*() const
+{
+	if (this->slot == this->map->ids.size())
+		return { size_t(EMPTY_SLOT), this->map->maxIdRow };
+	return { size_t(this->map->ids[this->slot]), this->map->rows[this->slot] };
+}
+
+id_map_t::const_iterator& id_map_t::const_iterator::operator++()
+{
+	++this->slot;
+	this->skipEmpty();
+	return *this;
+}
@@ -0,0 +1,57 @@
+#ifndef IDMAP_H
+#define IDMAP_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+// Maps ids of documents to their row inside a storage file. Open addressing with linear probing
+// over two flat arrays (12 bytes per slot, at most 70% of the slots are used), so there is no
+// allocation per document and a lookup usually touches one cache line
+class id_map_t {
+private:
+	static constexpr uint64_t EMPTY_SLOT = UINT64_MAX; // id of unused slots (UINT64_MAX itself is kept aside)
+
+	std::vector<uint64_t> ids;
+	std::vector<uint32_t> rows;
+	size_t count = 0;
+	bool hasMaxId = false; // the id UINT64_MAX cannot be stored inside a slot
+	uint32_t maxIdRow = 0;
+
+	size_t slotOf(uint64_t id) const;
+	void grow(size_t capacity);
+
+public:
+	class const_iterator {
+	private:
+		const id_map_t* map;
+		size_t slot; // ids.size() = the extra UINT64_MAX entry, ids.size() + 1 = end
+
+		void skipEmpty();
+
+	public:
+		const_iterator(const id_map_t* map, size_t slot);
+		std::pair<size_t, size_t> operator*() const; // 1. id of doc 2. row index
+		const_iterator& operator++();
+		bool operator!=(const const_iterator& other) const { return this->slot != other.slot; }
+		bool operator==(const const_iterator& other) const { return this->slot == other.slot; }
+	};
+
+	bool get(size_t id, size_t& row) const;
+	size_t at(size_t id) const; // throws std::out_of_range when the id is not inside
+	bool contains(size_t id) const;
+	void set(size_t id, size_t row);
+	bool erase(size_t id);
+
+	size_t size() const { return this->count; }
+	void reserve(size_t documents);
+	void clear();
+	void swap(id_map_t& other);
+	size_t memoryUsage() const;
+
+	const_iterator begin() const;
+	const_iterator end() const;
+};
+
+#endif // !IDMAP_H
@@ -17,7 +17,20 @@ void parseStartArguments(int argc, char* argv[])
         ("help,h", "Produce help message")
         ("apiPort", po::value<int>(), "Set API-Port to listen at")
         ("apiAddress", po::value<std::string>(), "Set API-Address to listen at")
-        ("dataPath", po::value<std::string>(), "Path to the data Folder");
+        ("dataPath", po::value<std::string>(), "Path to the data Folder")
+        ("shards", po::value<size_t>(), "Shards every new collection starts with (power of two, they split when they get full)")
+        ("mmapStorage", po::value<bool>(), "Read storage files through memory mappings (true/false)")
+        ("storageEncoding", po::value<std::string>(), "Encoding of written storage files (msgpack/cbor)")
+        ("wal", po::value<bool>(), "Make writes durable with a write-ahead log instead of saving after every request (true/false)")
+        ("incrementalSave", po::value<bool>(), "Append changes to storage files and only rewrite them when they get too fragmented (true/false)")
+        ("maxFragmentation", po::value<float>(), "Share of holes (0-1) in a storage file which forces a full rewrite on the next save")
+        ("compactionFragmentation", po::value<float>(), "Share of holes (0-1) in a storage file which lets the background compactor rewrite it")
+        ("compactionRate", po::value<size_t>(), "Megabytes per second the background compactor may rewrite (0 = unlimited)")
+        ("compressionLevel", po::value<int>(), "zlib level (1-9) of the storage files of new collections (0 = uncompressed)")
+        ("blockSize", po::value<size_t>(), "Kilobytes of rows which are compressed together")
+        ("cacheSize", po::value<size_t>(), "Megabytes of parsed documents every collection keeps in memory (0 = disabled)")
+        ("workers", po::value<size_t>(), "Threads which parse storage files in chunks for index builds and TTL checks (0 = one per core)")
+        ("saveLatency", po::value<size_t>(), "Milliseconds in which the changes of requests are collected into one save (without write-ahead log)");
 #pragma endregion
 
     // Parsing
@@ -45,6 +58,83 @@ void parseStartArguments(int argc, char* argv[])
         API_ADDRESS = vm["apiAddress"].as<std::string>();
         std::cout << "[VAR] apiAddress was set to " << API_ADDRESS << std::endl;
     }
+
+    if (vm.count("shards")) {
+        STORAGE_SHARDS = vm["shards"].as<size_t>();
+        if (!STORAGE_SHARDS || (STORAGE_SHARDS & (STORAGE_SHARDS - 1))) {
+            std::cout << "shards has to be a power of two" << std::endl;
+            exit(1);
+        }
+        std::cout << "[VAR] shards was set to " << STORAGE_SHARDS << std::endl;
+    }
+
+    if (vm.count("mmapStorage")) {
+        STORAGE_MEMORY_MAPPED = vm["mmapStorage"].as<bool>();
+        std::cout << "[VAR] mmapStorage was set to " << STORAGE_MEMORY_MAPPED << std::endl;
+    }
+
+    if (vm.count("storageEncoding")) {
+        STORAGE_ENCODING = vm["storageEncoding"].as<std::string>();
+        if (STORAGE_ENCODING != "msgpack" && STORAGE_ENCODING != "cbor") {
+            std::cout << "storageEncoding has to be msgpack or cbor" << std::endl;
+            exit(1);
+        }
+        std::cout << "[VAR] storageEncoding was set to " << STORAGE_ENCODING << std::endl;
+    }
+
+    if (vm.count("wal")) {
+        WAL_ACTIVE = vm["wal"].as<bool>();
+        std::cout << "[VAR] wal was set to " << WAL_ACTIVE << std::endl;
+    }
+
+    if (vm.count("incrementalSave")) {
+        STORAGE_INCREMENTAL_SAVE = vm["incrementalSave"].as<bool>();
+        std::cout << "[VAR] incrementalSave was set to " << STORAGE_INCREMENTAL_SAVE << std::endl;
+    }
+
+    if (vm.count("maxFragmentation")) {
+        MAX_STORAGE_FRAGMENTATION = vm["maxFragmentation"].as<float>();
+        std::cout << "[VAR] maxFragmentation was set to " << MAX_STORAGE_FRAGMENTATION << std::endl;
+    }
+
+    if (vm.count("compactionFragmentation")) {
+        COMPACTION_FRAGMENTATION = vm["compactionFragmentation"].as<float>();
+        std::cout << "[VAR] compactionFragmentation was set to " << COMPACTION_FRAGMENTATION << std::endl;
+    }
+
+    if (vm.count("compactionRate")) {
+        COMPACTION_RATE = vm["compactionRate"].as<size_t>();
+        std::cout << "[VAR] compactionRate was set to " << COMPACTION_RATE << std::endl;
+    }
+
+    if (vm.count("compressionLevel")) {
+        STORAGE_COMPRESSION_LEVEL = vm["compressionLevel"].as<int>();
+        if (STORAGE_COMPRESSION_LEVEL < 0 || STORAGE_COMPRESSION_LEVEL > 9) {
+            std::cout << "compressionLevel has to be between 0 and 9" << std::endl;
+            exit(1);
+        }
+        std::cout << "[VAR] compressionLevel was set to " << STORAGE_COMPRESSION_LEVEL << std::endl;
+    }
+
+    if (vm.count("blockSize")) {
+        STORAGE_BLOCK_SIZE = vm["blockSize"].as<size_t>();
+        std::cout << "[VAR] blockSize was set to " << STORAGE_BLOCK_SIZE << std::endl;
+    }
+
+    if (vm.count("cacheSize")) {
+        DOCUMENT_CACHE_SIZE = vm["cacheSize"].as<size_t>();
+        std::cout << "[VAR] cacheSize was set to " << DOCUMENT_CACHE_SIZE << std::endl;
+    }
+
+    if (vm.count("workers")) {
+        WORKER_THREADS = vm["workers"].as<size_t>();
+        std::cout << "[VAR] workers was set to " << WORKER_THREADS << std::endl;
+    }
+
+    if (vm.count("saveLatency")) {
+        SAVE_LATENCY = vm["saveLatency"].as<size_t>();
+        std::cout << "[VAR] saveLatency was set to " << SAVE_LATENCY << std::endl;
+    }
     
 #pragma endregion
 
@@ -13,7 +13,20 @@ inline int API_PORT = 3399;
 inline std::string API_ADDRESS = "127.0.0.1";
 inline bool AUTHENTICATION_ACTIVE = false;
 
-inline size_t MAX_ELEMENTS_IN_STORAGE = 50000;
+inline size_t MAX_ELEMENTS_IN_STORAGE = 50000; // shards split when they pass it
+inline size_t STORAGE_SHARDS = 8; // shards every new collection starts with (power of two), documents are placed by their hashed id
+inline bool STORAGE_MEMORY_MAPPED = false; // read storage files through a memory mapping instead of fstreams
+inline std::string STORAGE_ENCODING = "msgpack"; // binary encoding of rewritten storage files: msgpack or cbor
+inline bool WAL_ACTIVE = true; // log writes to a write-ahead log instead of saving the database after every request
+inline bool STORAGE_INCREMENTAL_SAVE = true; // append changes to storage files instead of rewriting them on every save
+inline int STORAGE_COMPRESSION_LEVEL = 0; // zlib level (1-9) of storage files of new collections (0 = uncompressed)
+inline size_t STORAGE_BLOCK_SIZE = 64; // kilobytes of rows which are compressed together
+inline float MAX_STORAGE_FRAGMENTATION = 0.5f; // share of holes in a storage file which forces a full rewrite
+inline float COMPACTION_FRAGMENTATION = 0.3f; // share of holes in a storage file which lets the background compactor rewrite it
+inline size_t COMPACTION_RATE = 8; // megabytes per second the background compactor may rewrite (0 = unlimited)
+inline size_t DOCUMENT_CACHE_SIZE = 64; // megabytes of parsed documents every collection keeps in memory (0 = disabled)
+inline size_t SAVE_LATENCY = 100; // milliseconds in which the changes of requests are collected into one save (without write-ahead log)
+inline size_t WORKER_THREADS = 0; // threads of the shared worker pool which parses storage files in chunks (0 = one per core)
 
 #pragma endregion
 
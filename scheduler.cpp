@@ -0,0 +1,107 @@
+#include <iostream>
+
+#include "main.h"
+#include "database.h"
+#include "scheduler.h"
+
+save_scheduler_t::save_scheduler_t()
+{
+	this->saver = std::thread(&save_scheduler_t::runSaver, this);
+}
+
+save_scheduler_t::~save_scheduler_t()
+{
+	std::unique_lock<std::mutex> lockGuard(this->scheduleLock);
+	this->stopSaver = true;
+	this->scheduleChanged.notify_all();
+	lockGuard.unlock();
+
+	if (this->saver.joinable())
+		this->saver.join();
+}
+
+uint64_t save_scheduler_t::markDirty(collection_t* col)
+{
+	// Remember the collection for the next save. Returns the ticket to wait for
+	std::unique_lock<std::mutex> lockGuard(this->scheduleLock);
+	if (!this->dirtyCollections.size())
+		this->dirtySince = std::chrono::steady_clock::now();
+
+	this->dirtyCollections[col] = ++this->lastTicket;
+	this->scheduleChanged.notify_one();
+	return this->lastTicket;
+}
+
+void save_scheduler_t::waitSaved(collection_t* col, uint64_t ticket)
+{
+	// Throws when the save with this change failed (it is tried again with the next one) or the saver stopped before
+	std::unique_lock<std::mutex> lockGuard(this->scheduleLock);
+	auto isSaved = [this, col, ticket]() { return this->savedTickets.count(col) && this->savedTickets[col] >= ticket; };
+	auto isFailed = [this, col, ticket]() { return this->failedSaves.count(col) && this->failedSaves[col].first >= ticket; };
+	this->saveDone.wait(lockGuard, [&]() { return isSaved() || isFailed() || this->saverStopped; });
+
+	if (isSaved())
+		return;
+	if (isFailed())
+		throw std::runtime_error("Cannot save collection " + col->name + ": " + this->failedSaves[col].second);
+	throw std::runtime_error("Collection " + col->name + " was not saved before the shutdown");
+}
+
+void save_scheduler_t::runSaver()
+{
+	std::unique_lock<std::mutex> lockGuard(this->scheduleLock);
+
+	while (true) {
+		this->scheduleChanged.wait(lockGuard, [this]() { return this->dirtyCollections.size() || this->stopSaver; });
+		if (!this->dirtyCollections.size())
+			break; // Stopped and everything is saved
+
+		// Let the changes of the latency window come in (stopping saves right away)
+		this->scheduleChanged.wait_until(lockGuard, this->dirtySince + std::chrono::milliseconds(SAVE_LATENCY), [this]() { return this->stopSaver; });
+
+		// Take everything which is dirty: all these changes share one save
+		std::map<collection_t*, uint64_t> batch;
+		batch.swap(this->dirtyCollections);
+		lockGuard.unlock();
+
+		std::map<collection_t*, std::string> failed;
+		for (const auto& [col, ticket] : batch) {
+			try {
+				saveCollection(col, DATA_PATH);
+			}
+			catch (const std::exception& ex) {
+				std::cout << "[WARNING] Cannot save collection " << col->name << ": " << ex.what() << std::endl;
+				failed[col] = ex.what();
+			}
+		}
+
+		// Every collection answers its own requests. Failed ones are tried again with the next save
+		// (their requests get the error, the changes stay in memory)
+		lockGuard.lock();
+		for (const auto& [col, ticket] : batch) {
+			if (!failed.count(col)) {
+				this->savedTickets[col] = ticket;
+				continue;
+			}
+
+			this->failedSaves[col] = { ticket, failed[col] };
+			if (!this->dirtyCollections.size())
+				this->dirtySince = std::chrono::steady_clock::now();
+			this->dirtyCollections.insert({ col, ticket }); // a newer change keeps its ticket
+		}
+		this->saveDone.notify_all();
+
+		if (failed.size() && this->stopSaver)
+			break;
+	}
+
+	// Nobody waits forever for a save which will not come
+	this->saverStopped = true;
+	this->saveDone.notify_all();
+}
+
+save_scheduler_t& getSaveScheduler()
+{
+	static save_scheduler_t saveScheduler;
+	return saveScheduler;
+}
@@ -0,0 +1,42 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <map>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+class collection_t;
+
+// Saves the collections which got changed by requests (without write-ahead log). Changes which come in
+// within SAVE_LATENCY milliseconds after the first one are written down together by one thread (the
+// storage files of a save are written on the worker pool), instead of one save per request
+class save_scheduler_t {
+private:
+	std::mutex scheduleLock;
+	std::condition_variable scheduleChanged; // saver waits for dirty collections
+	std::condition_variable saveDone; // requests wait until their changes are saved (or cannot be)
+	std::map<collection_t*, uint64_t> dirtyCollections; // 1. collection 2. ticket of its last change
+	std::chrono::steady_clock::time_point dirtySince; // first change which is not saved yet
+	uint64_t lastTicket = 0; // ticket of the last change (of any collection)
+	std::map<collection_t*, uint64_t> savedTickets; // every change of the collection up to this ticket is saved
+	std::map<collection_t*, std::pair<uint64_t, std::string>> failedSaves; // 1. last ticket inside the failed save 2. error
+	bool stopSaver = false;
+	bool saverStopped = false; // nothing gets saved anymore
+	std::thread saver;
+
+	void runSaver();
+
+public:
+	save_scheduler_t();
+	~save_scheduler_t();
+
+	uint64_t markDirty(collection_t* col);
+	void waitSaved(collection_t* col, uint64_t ticket);
+};
+
+save_scheduler_t& getSaveScheduler(); // shared by all requests (created on first use)
+
+#endif // !SCHEDULER_H
@@ -4,14 +4,398 @@
 #include <fstream>
 #include <chrono>
 #include <thread>
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+#include <iterator>
+#include <limits>
 
+#include <zlib.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#include "main.h"
 #include "CRUD/crud.h"
-#include "sha256.h"
 #include "storage.h"
+#include "workers.h"
+
+const std::string EMPTY_ROW_SEQUENCE = "<fgsngflwsitu948whg49ghwe98gh>"; // Text format only
+
+// Binary storage file layout (format version 4):
+//		header:	"KNNDB" | version (u8) | encoding (u8) | compression (u8) | last applied log sequence number (u64)
+//				| committed length (u64) | save generation (u64)		==> 32 bytes (version 1: only up to the lsn, 16 bytes)
+//		rows:	payload length (u32, little endian) | crc32 of the payload (u32) | payload (MessagePack/CBOR)	==> length 0 is an empty row
+// Version 2 and 3 files are still read, their rows do not have the crc32
+//
+// Block compressed files (compression = 1) store the same rows in independently compressed blocks:
+//		block:	compressed length (u32) | uncompressed length (u32) | zlib data of the rows
+// Row offsets point into the uncompressed rows then. The block index (first row offset and file offset of every block)
+// is built by walking the block headers, so a point read only decompresses the block of its row
+//
+// Incremental saves append rows behind the committed length and list the replaced/removed rows in the
+// tombstone sidecar (same name, .tomb extension) as batches of: save generation (u64) | count (u32) | rows (u64 each).
+// Both get fsynced before the header with the new committed length and generation is written (the commit)
+// Full rewrites write a temporary file (.tmp extension), fsync it and rename it over the storage file
+//
+// Id sidecar (same name, .ids extension), rewritten on every save so that loading does not have to parse every document:
+//		"KNNID" | version (u8) | reserved (u16) | committed length (u64) | save generation (u64) | fingerprint (u32)
+//		| row count (u64) | row offsets (u64 each) | document count (u64) | (id (u64), row (u64)) each | crc32 of everything before (u32)
+// The fingerprint is the crc32 of the storage header and the last committed bytes. It is only used when it matches the storage file
+//
+// A damaged file (a row which does not fit or whose crc32 does not match) is cut down to the rows in front of
+// the damage on loading. The whole file is copied next to it (.damaged extension) before
+const std::string STORAGE_MAGIC = "KNNDB";
+const size_t STORAGE_HEADER_SIZE = 32;
+const size_t STORAGE_HEADER_SIZE_V1 = 16;
+const uint8_t STORAGE_FORMAT_VERSION = 4;
+const uint8_t COMPRESSED_FORMAT_VERSION = 3; // block compression without row checksums (only read)
+const std::string ID_SIDECAR_MAGIC = "KNNID";
+const uint8_t ID_SIDECAR_VERSION = 1;
+const std::streamoff FINGERPRINT_TAIL_SIZE = 4096;
+const std::streamoff SCAN_CHUNK_SIZE = 1024 * 1024; // bytes of rows which doFuncOnAllDocuments parses in one pool task
+
+StorageFormat storageFormatFromName(const std::string& name)
+{
+	if (name == "msgpack")
+		return StorageFormat::MsgPack;
+	if (name == "cbor")
+		return StorageFormat::Cbor;
+
+	throw std::invalid_argument("Unknown storage encoding: " + name);
+}
+
+nlohmann::json decodeDocument(StorageFormat format, std::string_view data)
+{
+	switch (format) {
+	case StorageFormat::MsgPack:
+		return nlohmann::json::from_msgpack(data.begin(), data.end());
+	case StorageFormat::Cbor:
+		return nlohmann::json::from_cbor(data.begin(), data.end());
+	default:
+		return nlohmann::json::parse(data.begin(), data.end());
+	}
+}
+
+// Reads the big endian number of bytes at data (MessagePack and CBOR lengths)
+uint64_t readBigEndian(const uint8_t* data, size_t bytes)
+{
+	uint64_t value = 0;
+	for (size_t i = 0; i < bytes; ++i)
+		value = (value << 8) | data[i];
+	return value;
+}
+
+// Bytes of the MessagePack value at data, without building it (0 = does not fit in front of end or is invalid)
+size_t skipMsgPackValue(const uint8_t* data, const uint8_t* end, size_t depth = 0)
+{
+	if (data >= end || depth > 512)
+		return 0;
+
+	const uint8_t type = data[0];
+	size_t headerSize = 1, length = 0, items = 0;
+	if (type <= 0x7F || type >= 0xE0 || type == 0xC0 || type == 0xC2 || type == 0xC3)
+		return 1; // fixint, nil, bool
+	else if (type <= 0x8F)
+		items = size_t(type & 0x0F) * 2; // fixmap
+	else if (type <= 0x9F)
+		items = type & 0x0F; // fixarray
+	else if (type <= 0xBF)
+		length = type & 0x1F; // fixstr
+	else {
+		// Sizes of the header (with the length/count field) and of fixed size values
+		switch (type) {
+		case 0xC4: case 0xD9: headerSize = 2; break;				// bin8, str8
+		case 0xC5: case 0xDA: headerSize = 3; break;				// bin16, str16
+		case 0xC6: case 0xDB: headerSize = 5; break;				// bin32, str32
+		case 0xC7: headerSize = 3; break;							// ext8 (+ type byte)
+		case 0xC8: headerSize = 4; break;							// ext16
+		case 0xC9: headerSize = 6; break;							// ext32
+		case 0xCC: case 0xD0: return end - data >= 2 ? 2 : 0;		// (u)int8
+		case 0xCD: case 0xD1: return end - data >= 3 ? 3 : 0;		// (u)int16
+		case 0xCA: case 0xCE: case 0xD2: return end - data >= 5 ? 5 : 0; // float32, (u)int32
+		case 0xCB: case 0xCF: case 0xD3: return end - data >= 9 ? 9 : 0; // float64, (u)int64
+		case 0xD4: return end - data >= 3 ? 3 : 0;					// fixext 1
+		case 0xD5: return end - data >= 4 ? 4 : 0;					// fixext 2
+		case 0xD6: return end - data >= 6 ? 6 : 0;					// fixext 4
+		case 0xD7: return end - data >= 10 ? 10 : 0;				// fixext 8
+		case 0xD8: return end - data >= 18 ? 18 : 0;				// fixext 16
+		case 0xDC: case 0xDE: headerSize = 3; break;				// array16, map16
+		case 0xDD: case 0xDF: headerSize = 5; break;				// array32, map32
+		default: return 0;
+		}
+
+		if (end - data < std::ptrdiff_t(headerSize))
+			return 0;
+
+		const size_t lengthBytes = type == 0xC7 || type == 0xC8 || type == 0xC9 ? headerSize - 2 : headerSize - 1;
+		const uint64_t count = readBigEndian(data + 1, lengthBytes);
+		if (type == 0xDC || type == 0xDD)
+			items = count;
+		else if (type == 0xDE || type == 0xDF)
+			items = count * 2;
+		else
+			length = count;
+	}
+
+	// Strings and binaries: the bytes follow directly
+	size_t size = headerSize;
+	if (length)
+		return size_t(end - data) - size >= length ? size + length : 0;
+
+	// Arrays and maps: walk their items
+	for (size_t i = 0; i < items; ++i) {
+		const size_t itemSize = skipMsgPackValue(data + size, end, depth + 1);
+		if (!itemSize)
+			return 0;
+		size += itemSize;
+	}
+
+	return size;
+}
+
+// Bytes of the CBOR value at data, without building it (0 = does not fit in front of end or is invalid)
+size_t skipCborValue(const uint8_t* data, const uint8_t* end, size_t depth = 0)
+{
+	if (data >= end || depth > 512)
+		return 0;
+
+	const uint8_t major = data[0] >> 5, info = data[0] & 0x1F;
+	size_t size = 1;
+	uint64_t argument = info;
+	if (info >= 24 && info <= 27) {
+		const size_t argumentBytes = size_t(1) << (info - 24);
+		if (size_t(end - data) < 1 + argumentBytes)
+			return 0;
+		argument = readBigEndian(data + 1, argumentBytes);
+		size += argumentBytes;
+	}
+	else if (info > 27 && (info != 31 || major < 2 || major > 5))
+		return 0; // reserved or a break outside of an indefinite item
+
+	switch (major) {
+	case 0: case 1: case 7: // integers, floats and simple values
+		return size;
+	case 6: { // tag + tagged item
+		const size_t itemSize = skipCborValue(data + size, end, depth + 1);
+		return itemSize ? size + itemSize : 0;
+	}
+	case 2: case 3: // byte and text strings
+		if (info != 31)
+			return size_t(end - data) - size >= argument ? size + size_t(argument) : 0;
+		break;
+	}
+
+	// Arrays, maps and indefinite strings: walk their items (indefinite ones end with a break)
+	const uint64_t items = major == 5 ? argument * 2 : argument;
+	for (uint64_t i = 0; info == 31 || i < items; ++i) {
+		if (info == 31 && data + size < end && data[size] == 0xFF)
+			return size + 1;
+
+		const size_t itemSize = skipCborValue(data + size, end, depth + 1);
+		if (!itemSize)
+			return 0;
+		size += itemSize;
+	}
+
+	return size;
+}
+
+// Reads the head of the top level map (false = no map). pairs gets its number of key/value pairs (indefinite = max)
+bool readMapHead(StorageFormat format, const uint8_t*& data, const uint8_t* end, uint64_t& pairs)
+{
+	if (data >= end)
+		return false;
+
+	const uint8_t type = data[0];
+	if (format == StorageFormat::MsgPack) {
+		if (type >= 0x80 && type <= 0x8F) {
+			pairs = type & 0x0F;
+			data += 1;
+		}
+		else if ((type == 0xDE || type == 0xDF) && end - data >= (type == 0xDE ? 3 : 5)) {
+			pairs = readBigEndian(data + 1, type == 0xDE ? 2 : 4);
+			data += type == 0xDE ? 3 : 5;
+		}
+		else
+			return false;
+		return true;
+	}
+
+	const uint8_t info = type & 0x1F;
+	if ((type >> 5) != 5 || (info > 27 && info != 31))
+		return false;
+	if (info == 31) {
+		pairs = std::numeric_limits<uint64_t>::max();
+		data += 1;
+	}
+	else if (info >= 24) {
+		const size_t argumentBytes = size_t(1) << (info - 24);
+		if (size_t(end - data) < 1 + argumentBytes)
+			return false;
+		pairs = readBigEndian(data + 1, argumentBytes);
+		data += 1 + argumentBytes;
+	}
+	else {
+		pairs = info;
+		data += 1;
+	}
+	return true;
+}
 
-const std::string EMPTY_ROW_SEQUENCE = "<fgsngflwsitu948whg49ghwe98gh>";
+// Reads the (definite length) string key at data. Returns false when the key is something else
+bool readMapKey(StorageFormat format, const uint8_t*& data, const uint8_t* end, std::string_view& key)
+{
+	if (data >= end)
+		return false;
 
-nlohmann::json reduceJsonObject(nlohmann::json& input, std::map<std::string, bool>& projection) {
+	const uint8_t type = data[0];
+	size_t headerSize = 1;
+	uint64_t length = 0;
+	if (format == StorageFormat::MsgPack) {
+		if (type >= 0xA0 && type <= 0xBF)
+			length = type & 0x1F;
+		else if (type >= 0xD9 && type <= 0xDB) {
+			headerSize = 1 + (size_t(1) << (type - 0xD9));
+			if (size_t(end - data) < headerSize)
+				return false;
+			length = readBigEndian(data + 1, headerSize - 1);
+		}
+		else
+			return false;
+	}
+	else {
+		const uint8_t info = type & 0x1F;
+		if ((type >> 5) != 3 || info > 27)
+			return false;
+		if (info >= 24) {
+			headerSize = 1 + (size_t(1) << (info - 24));
+			if (size_t(end - data) < headerSize)
+				return false;
+			length = readBigEndian(data + 1, headerSize - 1);
+		}
+		else
+			length = info;
+	}
+
+	if (size_t(end - data) - headerSize < length)
+		return false;
+
+	key = std::string_view(reinterpret_cast<const char*>(data + headerSize), size_t(length));
+	data += headerSize + length;
+	return true;
+}
+
+nlohmann::json decodeProjectedDocument(StorageFormat format, std::string_view data, std::map<std::string, bool>& projection)
+{
+	// Only MessagePack and CBOR can be skip-scanned (without projection everything is needed anyway)
+	if (!projection.size() || (format != StorageFormat::MsgPack && format != StorageFormat::Cbor)) {
+		nlohmann::json document = decodeDocument(format, data);
+		return reduceJsonObject(document, projection);
+	}
+
+	// Walk the top level fields: wanted ones (id and the visible ones) are decoded, all others
+	// (mostly large vectors) are only skipped over
+	const uint8_t* position = reinterpret_cast<const uint8_t*>(data.data());
+	const uint8_t* end = position + data.size();
+	uint64_t pairs = 0;
+	nlohmann::json output = nlohmann::json::object();
+	bool valid = readMapHead(format, position, end, pairs);
+	for (uint64_t i = 0; valid && i < pairs; ++i) {
+		if (pairs == std::numeric_limits<uint64_t>::max() && position < end && *position == 0xFF)
+			break; // End of an indefinite CBOR map
+
+		std::string_view key;
+		if (!readMapKey(format, position, end, key)) {
+			valid = false;
+			break;
+		}
+
+		const size_t valueSize = format == StorageFormat::MsgPack ? skipMsgPackValue(position, end) : skipCborValue(position, end);
+		if (!valueSize) {
+			valid = false;
+			break;
+		}
+
+		const auto field = key == "id" ? projection.end() : projection.find(std::string(key));
+		if (key == "id" || (field != projection.end() && field->second)) {
+			output[std::string(key)] = format == StorageFormat::MsgPack
+				? nlohmann::json::from_msgpack(position, position + valueSize)
+				: nlohmann::json::from_cbor(position, position + valueSize);
+		}
+		position += valueSize;
+	}
+
+	if (valid)
+		return output;
+
+	// Something unexpected (no map at the top or keys which are no strings) ==> the slow way
+	nlohmann::json document = decodeDocument(format, data);
+	return reduceJsonObject(document, projection);
+}
+
+std::string encodeDocument(StorageFormat format, const nlohmann::json& document)
+{
+	std::string data;
+	switch (format) {
+	case StorageFormat::MsgPack:
+		nlohmann::json::to_msgpack(document, data);
+		break;
+	case StorageFormat::Cbor:
+		nlohmann::json::to_cbor(document, data);
+		break;
+	default:
+		data = document.dump();
+		break;
+	}
+
+	return data;
+}
+
+void syncFile(const std::filesystem::path& path)
+{
+	// Flush the file (or the entries of a directory) down to the disk. Throws when that fails
+	// (what was written since the last sync may be lost then)
+#ifdef _WIN32
+	if (std::filesystem::is_directory(path))
+		return; // Directory entries are written through on Windows
+
+	const int descriptor = _wopen(path.c_str(), _O_RDWR | _O_BINARY);
+	if (descriptor < 0)
+		throw std::runtime_error("Cannot open " + path.u8string() + " to fsync it");
+	const bool synced = _commit(descriptor) == 0;
+	_close(descriptor);
+#else
+	const int descriptor = open(path.c_str(), O_RDONLY);
+	if (descriptor < 0)
+		throw std::runtime_error("Cannot open " + path.u8string() + " to fsync it");
+	const bool synced = fsync(descriptor) == 0;
+	close(descriptor);
+#endif
+	if (!synced)
+		throw std::runtime_error("Cannot fsync " + path.u8string());
+}
+
+void replaceFile(const std::filesystem::path& from, const std::filesystem::path& to)
+{
+	// Atomically put from in the place of to: After a crash there is either the old or the
+	// complete new file
+	syncFile(from);
+	std::filesystem::rename(from, to);
+	syncFile(std::filesystem::absolute(to).parent_path());
+}
+
+uint32_t checksumOf(std::string_view data)
+{
+	return uint32_t(crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(data.data()), uInt(data.size())));
+}
+
+nlohmann::json reduceJsonObject(const nlohmann::json& input, std::map<std::string, bool>& projection) {
 	if (!projection.size()) // No projection given
 		return input;
 
@@ -27,104 +411,982 @@ nlohmann::json reduceJsonObject(nlohmann::json& input, std::map<std::string, boo
 	return output;
 }
 
+void performUpdates(nlohmann::json& document, const std::vector<nlohmann::json>& updates)
+{
+	// Perform Updates (in the order they came in)
+	for (const auto& update : updates) {
+		nlohmann::json oldDoc = std::move(document);
+		UPDATE::performUpdate(oldDoc, update, document);
+	}
+}
+
+
+//	*** change_set_t ***
+void change_set_t::merge(change_set_t& newer)
+{
+	// Put the newer changes on top of these ones (the newer set is empty afterwards). Removals come first:
+	// a document inside both removedDocuments and newDocuments of the newer set was removed and inserted again
+	for (const size_t& id : newer.removedDocuments) {
+		if (!this->newDocuments.erase(id))
+			this->removedDocuments.insert(id);
+		this->editedDocuments.erase(id);
+	}
+
+	for (auto& [id, updates] : newer.editedDocuments) {
+		const auto newDocument = this->newDocuments.find(id);
+		if (newDocument != this->newDocuments.end())
+			performUpdates(newDocument->second, updates);
+		else {
+			auto& edited = this->editedDocuments[id];
+			edited.insert(edited.end(), std::make_move_iterator(updates.begin()), std::make_move_iterator(updates.end()));
+		}
+	}
+
+	for (auto& [id, document] : newer.newDocuments)
+		this->newDocuments[id] = std::move(document);
+
+	this->lsn = std::max(this->lsn, newer.lsn);
+	newer.clear();
+}
+
+void change_set_t::clear()
+{
+	this->newDocuments.clear();
+	this->editedDocuments.clear();
+	this->removedDocuments.clear();
+	this->lsn = 0;
+}
+
+
+// Thrown while reading a damaged storage file. Everything in front of validLength can be kept
+class storage_damage_t : public std::runtime_error {
+public:
+	std::streamoff validLength;
+
+	storage_damage_t(std::streamoff validLength, const std::string& message)
+		: std::runtime_error(message), validLength(validLength) {}
+};
+
+// Payload of the binary row at data (end = behind the last readable byte). rowSize gets the bytes of the
+// whole row. Returns false when the row does not fit or its checksum does not match
+bool parseRow(const char* data, const char* end, bool checksummed, std::string_view& payload, std::streamoff& rowSize)
+{
+	const std::streamoff rowHeaderSize = checksummed ? 8 : 4;
+	if (end - data < rowHeaderSize || end - data - rowHeaderSize < readUInt32(data))
+		return false;
+
+	payload = std::string_view(data + rowHeaderSize, readUInt32(data));
+	rowSize = rowHeaderSize + payload.size();
+	return !checksummed || readUInt32(data + 4) == checksumOf(payload);
+}
+
+
+// Writes rows (always with checksums) at the end of a storage file. Without compression they go straight into the file,
+// otherwise they are collected into blocks of STORAGE_BLOCK_SIZE bytes which get compressed independently
+class row_writer_t {
+private:
+	std::ostream& stream;
+	int compressionLevel;
+	std::streamoff fileOffset;
+	std::streamoff rowsOffset; // offset of the next row inside the uncompressed rows
+	std::string block;
+	std::vector<std::pair<std::streamoff, std::streamoff>>& blockIndex;
+
+	void flushBlock() {
+		if (!this->block.size())
+			return;
+
+		uLongf length = compressBound(uLong(this->block.size()));
+		std::string compressedBlock(length, '\0');
+		compress2(reinterpret_cast<Bytef*>(compressedBlock.data()), &length, reinterpret_cast<const Bytef*>(this->block.data()), uLong(this->block.size()), this->compressionLevel);
+
+		this->blockIndex.push_back({ this->rowsOffset - std::streamoff(this->block.size()), this->fileOffset });
+		writeUInt32(this->stream, uint32_t(length));
+		writeUInt32(this->stream, uint32_t(this->block.size()));
+		this->stream.write(compressedBlock.data(), length);
+
+		this->fileOffset += 8 + length;
+		this->block.clear();
+	}
+
+public:
+	row_writer_t(std::ostream& stream, int compressionLevel, std::streamoff fileOffset, std::streamoff rowsOffset, std::vector<std::pair<std::streamoff, std::streamoff>>& blockIndex)
+		: stream(stream), compressionLevel(compressionLevel), fileOffset(fileOffset), rowsOffset(rowsOffset), blockIndex(blockIndex) {}
+
+	std::streamoff write(std::string_view payload) {
+		// Returns the offset of the row (inside the uncompressed rows for compressed files)
+		const uint32_t length = uint32_t(payload.size());
+		const uint32_t checksum = checksumOf(payload);
+		const char rowHeader[8] = {
+			char(length & 0xFF), char((length >> 8) & 0xFF), char((length >> 16) & 0xFF), char((length >> 24) & 0xFF),
+			char(checksum & 0xFF), char((checksum >> 8) & 0xFF), char((checksum >> 16) & 0xFF), char((checksum >> 24) & 0xFF)
+		};
+
+		if (!this->compressionLevel) {
+			const std::streamoff offset = this->fileOffset;
+			this->stream.write(rowHeader, 8);
+			this->stream.write(payload.data(), payload.size());
+			this->fileOffset += 8 + payload.size();
+			return offset;
+		}
+
+		if (this->block.size() && this->block.size() + 8 + payload.size() > STORAGE_BLOCK_SIZE * 1024)
+			this->flushBlock();
+
+		this->block.append(rowHeader, 8);
+		this->block.append(payload.data(), payload.size());
+
+		const std::streamoff offset = this->rowsOffset;
+		this->rowsOffset += 8 + payload.size();
+		return offset;
+	}
+
+	std::streamoff finish() {
+		// Returns the end of the written data inside the file
+		this->flushBlock();
+		return this->fileOffset;
+	}
+
+	std::streamoff getRowsOffset() { return this->rowsOffset; }
+};
 
-group_storage_t::group_storage_t(std::string storagePath)
+
+group_storage_t::group_storage_t(std::string storagePath, document_cache_t* cache, int compressionLevel, std::mutex* mutationLock)
 {
 	this->storagePath = storagePath;
+	this->cache = cache;
+	this->mutationLock = mutationLock;
+	this->compressionLevel = compressionLevel;
 	this->idPositions = {};
+	this->rowOffsets = {};
+
+	// Create storage file when needed (only the header), so that the write-ahead
+	// log can rely on every storage being on disk
+	if (!std::filesystem::exists(this->storagePath)) {
+		std::ofstream newFile(this->storagePath, std::ios::out | std::ios::binary);
+		this->storageFormat = storageFormatFromName(STORAGE_ENCODING);
+		this->writeHeader(newFile, this->storageFormat, STORAGE_HEADER_SIZE, 0);
+		newFile.close();
+		syncFile(this->storagePath);
+		syncFile(std::filesystem::absolute(this->storagePath).parent_path());
+	}
+	std::filesystem::remove(this->temporaryPath()); // left by a rewrite which never finished
+
+	this->mapStorageFile();
+	this->readHeader();
+	this->loadTombstones();
+
+	// A damaged file is cut down in front of the damage. Every try cuts something
+	// off, so this ends (at the latest with a file without rows)
+	while (true) {
+		try {
+			this->loadRows();
+			break;
+		}
+		catch (const storage_damage_t& damage) {
+			this->salvage(damage.validLength, damage.what());
+		}
+	}
+}
 
-	// Open storage file (will create it if needed)
-	this->storageFile = std::fstream(this->storagePath);
+void group_storage_t::loadRows()
+{
+	if (this->compressed)
+		this->loadBlockIndex();
+	if (this->loadIdSidecar())
+		return; // Everything is known without parsing the documents
 
 	// Load documentIDs from storage-file and insert them into
-	// idPositions for faster access
-	std::string line;
+	// idPositions for faster access. Also remember where every row starts
 	size_t index = 0;
-	while (std::getline(this->storageFile, line)) {
-		if (line != EMPTY_ROW_SEQUENCE) {
-			nlohmann::json document = nlohmann::json::parse(line);
-			auto id = document["id"];
-			this->idPositions[document["id"].get<size_t>()] = index;
-		}		
+	this->visitRows(nullptr, [this, &index](std::streamoff offset, std::string_view row) {
+		this->rowOffsets.push_back(offset);
+
+		if (row.size()) {
+			nlohmann::json document;
+			size_t id = 0;
+			try {
+				document = decodeDocument(this->storageFormat, row);
+				id = document["id"].get<size_t>();
+			}
+			catch (const std::exception& ex) {
+				const std::streamoff validLength = this->compressed ? this->blockIndex[this->blockOf(offset)].second : offset;
+				throw storage_damage_t(validLength, "Storage row cannot be parsed: " + std::string(ex.what()));
+			}
+
+			// A newer version of a document wins (only after a crash in the middle of a save)
+			size_t oldRow = 0;
+			if (this->idPositions.get(id, oldRow))
+				this->markHole(oldRow);
+			this->idPositions.set(id, index);
+		}
+		else
+			++this->holeCount;
 		++index;
+	});
+	this->tombstoned.resize(this->rowOffsets.size());
+
+	// Next start can use the sidecar again
+	if (this->headerSize == STORAGE_HEADER_SIZE)
+		this->writeIdSidecar();
+}
+
+void group_storage_t::salvage(std::streamoff validLength, const std::string& reason)
+{
+	// Keep everything in front of validLength (a copy of the whole file is kept for manual recovery)
+	// and forget what was loaded so far
+	if (validLength >= this->dataLength)
+		throw std::runtime_error(reason); // Nothing to cut off
+
+	// Every damage gets its own copy (.damaged, .damaged.1, ...), older ones are never overwritten
+	std::filesystem::path damagedPath = std::filesystem::path(this->storagePath).replace_extension(".damaged");
+	for (size_t copy = 1; std::filesystem::exists(damagedPath); ++copy)
+		damagedPath = std::filesystem::path(this->storagePath).replace_extension(".damaged." + std::to_string(copy));
+	std::cout << "[WARNING] " << reason << " (" << this->storagePath.u8string() << "). Keeping the first " << validLength
+		<< " of " << this->dataLength << " bytes, the whole file is copied to " << damagedPath.u8string() << std::endl;
+
+	std::filesystem::copy_file(this->storagePath, damagedPath);
+	this->dataLength = std::max(validLength, std::streamoff(this->headerSize));
+
+	if (this->headerSize == STORAGE_HEADER_SIZE) {
+		// Commit the shorter length, so that the next start does not run into the damage again
+		this->unmapStorageFile();
+		std::fstream file(this->storagePath, std::ios::in | std::ios::out | std::ios::binary);
+		file.seekp(16);
+		writeUInt64(file, uint64_t(this->dataLength));
+		file.close();
+		syncFile(this->storagePath);
+		this->mapStorageFile();
 	}
-	storageFile.close();
+
+	this->rowOffsets.clear();
+	this->idPositions.clear();
+	this->blockIndex.clear();
+	this->uncompressedLength = 0;
+	this->holeCount = 0;
+	this->tombstoned.clear();
+	this->loadTombstones();
 }
 
 bool group_storage_t::savedHere(size_t documentID)
 {
-	// True if it is inside idPositions or inside newDocuments
-	return (this->idPositions.count(documentID) || this->newDocuments.count(documentID));
+	// True if its newest version (changes, snapshot or storage file) was not removed
+	std::shared_lock<std::shared_mutex> lockGuard(this->stateLock);
+	return this->changes.newDocuments.count(documentID)
+		|| (!this->changes.removedDocuments.count(documentID) && this->existsBelow(documentID));
+}
+
+bool group_storage_t::existsBelow(size_t id)
+{
+	// True if the document exists below the changes (inside the snapshot or the storage file).
+	// stateLock has to be held by the caller
+	return this->snapshot.newDocuments.count(id)
+		|| (this->idPositions.contains(id) && !this->snapshot.removedDocuments.count(id));
 }
 
 void group_storage_t::getDocuments(std::vector<size_t>* ids, std::vector<nlohmann::json>& documents, bool allDocuments, std::map<std::string, bool> projection)
 {
-	std::unique_lock<std::mutex> lockGuard(this->fileLock, std::defer_lock);
-	documents.reserve(ids->size());
+	// Readers share the storage: they only block while a snapshot gets taken or a save swaps the state.
+	// Full scans only take what they need out of the changes and pin the storage file (fileLock) while
+	// they read it, so that writers do not wait for them
+	std::shared_lock<std::shared_mutex> fileGuard(this->fileLock, std::defer_lock);
+	if (allDocuments)
+		fileGuard.lock();
+	std::shared_lock<std::shared_mutex> lockGuard(this->stateLock);
+	std::vector<size_t> allIds = {};
+	if (allDocuments) {
+		this->collectIds(allIds);
+		ids = &allIds;
+	}
+	documents.reserve(documents.size() + ids->size());
 	
-	// Convert ids to block rows
+	// The newest version wins: changes, then the snapshot which is written right now, then the storage file.
+	// Convert ids of the storage file to block rows (cached documents do not have to be read)
 	std::map<size_t, size_t> rows = {};
+	std::unordered_map<size_t, std::vector<nlohmann::json>> pendingUpdates = {}; // 1. id of doc 2. updates which are not saved yet (older ones first)
 	for (auto it = ids->begin(); it != ids->end(); ++it) {
-		if (this->idPositions.count(*it))
-			rows[idPositions[*it]] = *it;
+		const auto newDocument = this->changes.newDocuments.find(*it);
+		if (newDocument != this->changes.newDocuments.end()) {
+			documents.push_back(reduceJsonObject(newDocument->second, projection));
+			continue;
+		}
+		if (this->changes.removedDocuments.count(*it))
+			continue;
+
+		const auto snapshotDocument = this->snapshot.newDocuments.find(*it);
+		if (snapshotDocument != this->snapshot.newDocuments.end()) {
+			nlohmann::json doc = snapshotDocument->second;
+			const auto edited = this->changes.editedDocuments.find(*it);
+			if (edited != this->changes.editedDocuments.end())
+				performUpdates(doc, edited->second);
+			documents.push_back(reduceJsonObject(doc, projection));
+			continue;
+		}
+
+		size_t row = 0;
+		if (this->snapshot.removedDocuments.count(*it) || !this->idPositions.get(*it, row))
+			continue;
+
+		std::shared_ptr<const nlohmann::json> cached = nullptr;
+		const auto snapshotEdited = this->snapshot.editedDocuments.find(*it);
+		const auto edited = this->changes.editedDocuments.find(*it);
+		if (snapshotEdited != this->snapshot.editedDocuments.end() || edited != this->changes.editedDocuments.end()) {
+			std::vector<nlohmann::json>& updates = pendingUpdates[*it];
+			if (snapshotEdited != this->snapshot.editedDocuments.end())
+				updates = snapshotEdited->second;
+			if (edited != this->changes.editedDocuments.end())
+				updates.insert(updates.end(), edited->second.begin(), edited->second.end());
+			rows[row] = *it;
+		}
+		else if (!allDocuments && this->cache != nullptr && this->cache->get(*it, cached))
+			documents.push_back(reduceJsonObject(*cached, projection));
+		else
+			rows[row] = *it;
 	}
 
-	// Get documents from newDocuments
-	for (auto it = ids->begin(); it != ids->end(); ++it) {
-		if (this->newDocuments.count(*it) || allDocuments) 
-			documents.push_back(reduceJsonObject(this->newDocuments[*it], projection));
-		
-			
+	// Point reads keep the stateLock, so that documents only go into the cache while no writer can invalidate them
+	if (allDocuments)
+		lockGuard.unlock();
+
+	// Get documents from storage file (jump directly to the selected rows)
+	std::vector<size_t> selectedRows = {};
+	selectedRows.reserve(rows.size());
+	for (const auto& [row, id] : rows)
+		selectedRows.push_back(row);
+
+	this->visitRows(&selectedRows, [this, &documents, &projection, &pendingUpdates, allDocuments](std::streamoff, std::string_view row) {
+		if (!row.size())
+			return; // Empty row
+
+		// With a projection only the requested fields get parsed. Such documents are not complete and do not go into the cache
+		nlohmann::json doc = projection.size() ? decodeProjectedDocument(this->storageFormat, row, projection) : decodeDocument(this->storageFormat, row);
+		const size_t id = doc["id"].get<size_t>();
+		const auto updates = pendingUpdates.find(id);
+
+		if (updates != pendingUpdates.end()) {
+			// Not saved yet ==> perform the waiting updates on the whole document
+			if (projection.size())
+				doc = decodeDocument(this->storageFormat, row);
+			performUpdates(doc, updates->second);
+		}
+		else if (!allDocuments && this->cache != nullptr && !projection.size()) {
+			// Remember it for the next time (the cache shares it)
+			std::shared_ptr<const nlohmann::json> cached = std::make_shared<const nlohmann::json>(std::move(doc));
+			this->cache->put(id, cached);
+			documents.push_back(*cached);
+			return;
+		}
+		else if (projection.size()) {
+			documents.push_back(std::move(doc)); // Already reduced
+			return;
+		}
+
+		documents.push_back(reduceJsonObject(doc, projection));
+	});
+}
+
+void group_storage_t::mapStorageFile()
+{
+	// Map the whole file read-only. Empty (or not yet existing) files cannot
+	// be mapped, they are read with the stream path instead
+	if (!STORAGE_MEMORY_MAPPED || !std::filesystem::exists(this->storagePath) || !std::filesystem::file_size(this->storagePath))
+		return;
+
+	namespace bip = boost::interprocess;
+	this->storageMapping = bip::file_mapping(this->storagePath.u8string().c_str(), bip::read_only);
+	this->storageRegion = bip::mapped_region(this->storageMapping, bip::read_only);
+}
+
+void group_storage_t::unmapStorageFile()
+{
+	this->storageRegion = boost::interprocess::mapped_region();
+	this->storageMapping = boost::interprocess::file_mapping();
+}
+
+void group_storage_t::readHeader()
+{
+	// Binary files start with the magic, everything else is the (old) text format.
+	// Files which do not exist yet will be written in the configured encoding
+	char header[STORAGE_HEADER_SIZE] = {};
+	size_t headerSize = 0;
+	std::streamoff fileSize = 0;
+
+	if (this->storageRegion.get_size()) {
+		fileSize = this->storageRegion.get_size();
+		headerSize = std::min(this->storageRegion.get_size(), STORAGE_HEADER_SIZE);
+		std::memcpy(header, this->storageRegion.get_address(), headerSize);
+	}
+	else {
+		std::ifstream file(this->storagePath, std::ios::in | std::ios::binary);
+		file.read(header, STORAGE_HEADER_SIZE);
+		headerSize = file.gcount();
+		fileSize = std::filesystem::exists(this->storagePath) ? std::filesystem::file_size(this->storagePath) : 0;
 	}
 
-	// Get documents from storage file
-	lockGuard.lock();
-	this->storageFile = std::fstream(this->storagePath);
-	std::string line;
-	size_t index = 0;
-	while (std::getline(this->storageFile, line)) {
-		++index;
-		if (rows.count(index - 1) || allDocuments) {
-			// Block row is selected ==> Parse JSON and set it
-			nlohmann::json doc = nlohmann::json::parse(line);
-			documents.push_back(reduceJsonObject(doc, projection));
+	this->dataLength = fileSize;
+	if (!headerSize) {
+		this->storageFormat = storageFormatFromName(STORAGE_ENCODING);
+		return;
+	}
+
+	if (headerSize < STORAGE_HEADER_SIZE_V1 || std::string_view(header, STORAGE_MAGIC.size()) != STORAGE_MAGIC) {
+		this->storageFormat = StorageFormat::Text;
+		this->headerSize = 0;
+		return;
+	}
+
+	const uint8_t version = uint8_t(header[5]);
+	if (version > STORAGE_FORMAT_VERSION)
+		throw std::runtime_error("Storage file was written by a newer version: " + this->storagePath.u8string());
+
+	this->storageFormat = static_cast<StorageFormat>(header[6]);
+	this->persistedLsn = this->pendingLsn = readUInt64(header + 8);
+
+	if (version == 1) {
+		this->headerSize = STORAGE_HEADER_SIZE_V1;
+		return;
+	}
+
+	// Everything behind the committed length belongs to a save which never finished
+	this->headerSize = STORAGE_HEADER_SIZE;
+	this->dataLength = std::min(fileSize, std::streamoff(readUInt64(header + 16)));
+	this->generation = readUInt64(header + 24);
+
+	this->compressed = version >= COMPRESSED_FORMAT_VERSION && header[7] == 1;
+	this->checksummed = version >= STORAGE_FORMAT_VERSION;
+}
+
+void group_storage_t::writeHeader(std::ostream& stream, StorageFormat format, std::streamoff dataLength, uint64_t generation, bool compressed)
+{
+	// Always the newest version (with row checksums), older builds refuse it instead of misreading the rows
+	char header[8] = {};
+	std::memcpy(header, STORAGE_MAGIC.data(), STORAGE_MAGIC.size());
+	header[5] = char(STORAGE_FORMAT_VERSION);
+	header[6] = char(format);
+	header[7] = char(compressed ? 1 : 0);
+	stream.write(header, 8);
+	writeUInt64(stream, this->snapshot.lsn);
+	writeUInt64(stream, uint64_t(dataLength));
+	writeUInt64(stream, generation);
+}
+
+void group_storage_t::loadBlockIndex()
+{
+	// Walk through the block headers of a compressed file (only 8 bytes per block are read)
+	std::ifstream file(this->storagePath, std::ios::in | std::ios::binary);
+	this->blockIndex.clear();
+	this->uncompressedLength = 0;
+
+	char blockHeader[8];
+	for (std::streamoff offset = this->headerSize; offset < this->dataLength;) {
+		file.seekg(offset);
+		if (this->dataLength - offset < 8 || !file.read(blockHeader, 8) || this->dataLength - offset - 8 < std::streamoff(readUInt32(blockHeader)))
+			throw storage_damage_t(offset, "Storage block is truncated");
+
+		this->blockIndex.push_back({ this->uncompressedLength, offset });
+		this->uncompressedLength += readUInt32(blockHeader + 4);
+		offset += 8 + readUInt32(blockHeader);
+	}
+}
+
+size_t group_storage_t::blockOf(std::streamoff rowOffset)
+{
+	// Last block which starts in front of the row (compressed files only)
+	return std::upper_bound(this->blockIndex.begin(), this->blockIndex.end(), rowOffset,
+		[](std::streamoff value, const std::pair<std::streamoff, std::streamoff>& item) { return value < item.first; }) - this->blockIndex.begin() - 1;
+}
+
+void group_storage_t::readBlock(std::istream& file, size_t block, std::string& buffer)
+{
+	// Decompress one block into buffer. It is read from the mapping or from file (the
+	// storage file, opened by the caller)
+	const std::streamoff offset = this->blockIndex[block].second;
+	char blockHeader[8];
+	std::string compressedBlock;
+	const char* source = nullptr;
 
-			if (documents.size() >= ids->size()) // Finished
-				break;
+	if (this->storageRegion.get_size()) {
+		source = static_cast<const char*>(this->storageRegion.get_address()) + offset;
+		std::memcpy(blockHeader, source, 8);
+		source += 8;
+	}
+	else {
+		file.clear();
+		file.seekg(offset);
+		file.read(blockHeader, 8);
+		compressedBlock.resize(readUInt32(blockHeader));
+		file.read(compressedBlock.data(), compressedBlock.size());
+		source = compressedBlock.data();
+	}
+
+	buffer.resize(readUInt32(blockHeader + 4));
+	uLongf length = uLongf(buffer.size());
+	if (uncompress(reinterpret_cast<Bytef*>(buffer.data()), &length, reinterpret_cast<const Bytef*>(source), readUInt32(blockHeader)) != Z_OK || length != buffer.size())
+		throw storage_damage_t(offset, "Storage block is damaged");
+}
+
+std::filesystem::path group_storage_t::temporaryPath()
+{
+	return std::filesystem::path(this->storagePath).replace_extension(".tmp");
+}
+
+std::filesystem::path group_storage_t::tombstonePath()
+{
+	return std::filesystem::path(this->storagePath).replace_extension(".tomb");
+}
+
+void group_storage_t::loadTombstones()
+{
+	// Apply every batch of a finished save. A batch with a newer generation belongs to a save
+	// which never finished ==> cut it (and everything behind) off
+	const std::filesystem::path path = this->tombstonePath();
+	if (!std::filesystem::exists(path))
+		return;
+
+	std::ifstream file(path, std::ios::in | std::ios::binary);
+	std::streamoff validSize = 0;
+	char batchHeader[12];
+	std::vector<char> rows;
+
+	while (file.read(batchHeader, 12)) {
+		rows.resize(size_t(readUInt32(batchHeader + 8)) * 8);
+		if (readUInt64(batchHeader) > this->generation || !file.read(rows.data(), rows.size()))
+			break;
+
+		for (size_t i = 0; i < rows.size(); i += 8) {
+			const size_t row = readUInt64(rows.data() + i);
+			if (row >= this->tombstoned.size())
+				this->tombstoned.resize(row + 1);
+			this->tombstoned[row] = true;
+		}
+		validSize += 12 + rows.size();
+	}
+	file.close();
+
+	if (std::filesystem::file_size(path) != uintmax_t(validSize))
+		std::filesystem::resize_file(path, validSize);
+}
+
+std::filesystem::path group_storage_t::idSidecarPath()
+{
+	return std::filesystem::path(this->storagePath).replace_extension(".ids");
+}
+
+uint32_t group_storage_t::dataFingerprint()
+{
+	// crc32 of the header and the last committed bytes: Changes with every save, but
+	// costs the same for every file size
+	std::ifstream file(this->storagePath, std::ios::in | std::ios::binary);
+	const std::streamoff tailBegin = std::max(std::streamoff(this->headerSize), this->dataLength - FINGERPRINT_TAIL_SIZE);
+	std::string buffer(this->headerSize + (this->dataLength - tailBegin), '\0');
+
+	file.read(buffer.data(), this->headerSize);
+	file.seekg(tailBegin);
+	file.read(buffer.data() + this->headerSize, this->dataLength - tailBegin);
+
+	return checksumOf(buffer);
+}
+
+bool group_storage_t::loadIdSidecar()
+{
+	// Fill idPositions and rowOffsets from the sidecar. Returns false (and changes nothing)
+	// when it is missing, damaged or belongs to another version of the storage file
+	const std::filesystem::path path = this->idSidecarPath();
+	if (this->headerSize != STORAGE_HEADER_SIZE || !std::filesystem::exists(path))
+		return false;
+
+	std::ifstream file(path, std::ios::in | std::ios::binary);
+	const std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if (content.size() < 48)
+		return false;
+
+	const char* data = content.data();
+	const size_t bodySize = content.size() - 4;
+	if (readUInt32(data + bodySize) != checksumOf(std::string_view(data, bodySize)))
+		return false; // Damaged
+
+	if (std::string_view(data, ID_SIDECAR_MAGIC.size()) != ID_SIDECAR_MAGIC || uint8_t(data[5]) != ID_SIDECAR_VERSION)
+		return false;
+	if (readUInt64(data + 8) != uint64_t(this->dataLength) || readUInt64(data + 16) != this->generation || readUInt32(data + 24) != this->dataFingerprint())
+		return false; // Belongs to another version
+
+	const uint64_t rowCount = readUInt64(data + 28);
+	if (36 + rowCount * 8 + 8 > bodySize)
+		return false;
+	const char* idData = data + 36 + rowCount * 8;
+	const uint64_t documentCount = readUInt64(idData);
+	if (36 + rowCount * 8 + 8 + documentCount * 16 != bodySize)
+		return false;
+
+	this->rowOffsets.resize(rowCount);
+	for (size_t row = 0; row < rowCount; ++row)
+		this->rowOffsets[row] = std::streamoff(readUInt64(data + 36 + row * 8));
+
+	this->idPositions.reserve(documentCount);
+	for (size_t i = 0; i < documentCount; ++i)
+		this->idPositions.set(readUInt64(idData + 8 + i * 16), readUInt64(idData + 16 + i * 16));
+
+	this->holeCount = rowCount - documentCount;
+	this->tombstoned.resize(rowCount);
+	return true;
+}
+
+void group_storage_t::writeIdSidecar()
+{
+	// Written after the storage file got committed (an older sidecar does not match anymore)
+	std::ostringstream content;
+	char magic[8] = {};
+	std::memcpy(magic, ID_SIDECAR_MAGIC.data(), ID_SIDECAR_MAGIC.size());
+	magic[5] = char(ID_SIDECAR_VERSION);
+	content.write(magic, 8);
+	writeUInt64(content, uint64_t(this->dataLength));
+	writeUInt64(content, this->generation);
+	writeUInt32(content, this->dataFingerprint());
+
+	writeUInt64(content, this->rowOffsets.size());
+	for (const std::streamoff& offset : this->rowOffsets)
+		writeUInt64(content, uint64_t(offset));
+
+	writeUInt64(content, this->idPositions.size());
+	for (const auto& [id, row] : this->idPositions) {
+		writeUInt64(content, id);
+		writeUInt64(content, row);
+	}
+
+	const std::string body = content.str();
+	std::ofstream file(this->idSidecarPath(), std::ios::out | std::ios::trunc | std::ios::binary);
+	file.write(body.data(), body.size());
+	writeUInt32(file, checksumOf(body));
+}
+
+void group_storage_t::markHole(size_t row)
+{
+	if (row >= this->tombstoned.size())
+		this->tombstoned.resize(row + 1);
+
+	if (!this->tombstoned[row]) {
+		this->tombstoned[row] = true;
+		++this->holeCount;
+	}
+}
+
+void group_storage_t::visitRows(const std::vector<size_t>* rows, const std::function<void(std::streamoff, std::string_view)>& func)
+{
+	// Fires func for every row (rows == nullptr) or only for the given (sorted) row indexes
+	// with the offset and the payload of that row (empty rows have an empty payload).
+	// Tombstoned rows are handed out as empty rows
+	// stateLock or fileLock (shared is enough) or writeLock has to be held by the caller. Every call reads with its own
+	// stream (or the shared mapping), so any number of readers can run at the same time
+	const bool isText = this->storageFormat == StorageFormat::Text;
+	const std::streamoff firstOffset = this->headerSize;
+	auto isTombstoned = [this](size_t row) { return row < this->tombstoned.size() && this->tombstoned[row]; };
+
+	if (this->compressed) {
+		// Block compressed: Decompress one block after another (point reads only the blocks of their rows)
+		std::ifstream file;
+		if (!this->storageRegion.get_size())
+			file.open(this->storagePath, std::ios::in | std::ios::binary);
+
+		std::string block;
+		auto rowAt = [this, &block](size_t blockNumber, std::streamoff offset, std::streamoff& next) {
+			std::string_view payload;
+			std::streamoff rowSize = 0;
+			if (!parseRow(block.data() + offset, block.data() + block.size(), this->checksummed, payload, rowSize))
+				throw storage_damage_t(this->blockIndex[blockNumber].second, "Storage row is damaged");
+
+			next = offset + rowSize;
+			return payload;
+		};
+
+		std::streamoff next = 0;
+		if (rows == nullptr) {
+			size_t row = 0;
+			for (size_t blockNumber = 0; blockNumber < this->blockIndex.size(); ++blockNumber) {
+				this->readBlock(file, blockNumber, block);
+
+				for (std::streamoff offset = 0; offset < std::streamoff(block.size()); offset = next, ++row) {
+					const std::string_view payload = rowAt(blockNumber, offset, next);
+					func(this->blockIndex[blockNumber].first + offset, isTombstoned(row) ? std::string_view() : payload);
+				}
+			}
+		}
+		else {
+			size_t loadedBlock = this->blockIndex.size();
+			for (const size_t& row : *rows) {
+				if (row >= this->rowOffsets.size())
+					continue;
+
+				const std::streamoff offset = this->rowOffsets[row];
+				const size_t blockNumber = this->blockOf(offset);
+
+				if (blockNumber != loadedBlock) {
+					this->readBlock(file, blockNumber, block);
+					loadedBlock = blockNumber;
+				}
+				func(offset, rowAt(blockNumber, offset - this->blockIndex[blockNumber].first, next));
+			}
+		}
+
+		return;
+	}
+
+	if (this->storageRegion.get_size()) {
+		// Memory mapped: Read the rows straight out of the mapping
+		const char* begin = static_cast<const char*>(this->storageRegion.get_address());
+		const char* end = begin + std::min(std::streamoff(this->storageRegion.get_size()), this->dataLength);
+
+		// Returns the payload of the row at offset and sets next to the offset of the following row
+		auto rowAt = [this, begin, end, isText](std::streamoff offset, std::streamoff& next) {
+			const char* rowBegin = begin + offset;
+
+			if (isText) {
+				const char* rowEnd = static_cast<const char*>(std::memchr(rowBegin, '\n', end - rowBegin));
+				std::string_view line(rowBegin, (rowEnd != nullptr ? rowEnd : end) - rowBegin);
+				next = offset + line.size() + 1; // + newline
+
+				return line == EMPTY_ROW_SEQUENCE ? std::string_view() : line;
+			}
+
+			std::string_view payload;
+			std::streamoff rowSize = 0;
+			if (!parseRow(rowBegin, end, this->checksummed, payload, rowSize))
+				throw storage_damage_t(offset, "Storage row is damaged");
+
+			next = offset + rowSize;
+			return payload;
+		};
+
+		std::streamoff next = 0;
+		if (rows == nullptr) {
+			size_t row = 0;
+			for (std::streamoff offset = firstOffset; begin + offset < end; offset = next, ++row) {
+				const std::string_view payload = rowAt(offset, next);
+				func(offset, isTombstoned(row) ? std::string_view() : payload);
+			}
+		}
+		else {
+			for (const size_t& row : *rows) {
+				if (row < this->rowOffsets.size())
+					func(this->rowOffsets[row], rowAt(this->rowOffsets[row], next));
+			}
+		}
+
+		return;
+	}
+
+	// Stream: Open storage file (binary mode, so that the offsets are exact bytes)
+	std::ifstream file(this->storagePath, std::ios::in | std::ios::binary);
+	std::string buffer;
+
+	// Reads the row at the current position into buffer. Returns false at the end of the file
+	const std::streamoff rowHeaderSize = this->checksummed ? 8 : 4;
+	auto readRow = [this, &file, &buffer, isText, rowHeaderSize]() {
+		const std::streamoff offset = file.tellg();
+		if (offset < 0 || offset >= this->dataLength)
+			return false; // Not committed
+
+		if (isText) {
+			if (!std::getline(file, buffer))
+				return false;
+			if (buffer == EMPTY_ROW_SEQUENCE)
+				buffer.clear();
+			return true;
+		}
+
+		char rowHeader[8];
+		if (this->dataLength - offset < rowHeaderSize || !file.read(rowHeader, rowHeaderSize))
+			throw storage_damage_t(offset, "Storage row is damaged");
+
+		buffer.resize(readUInt32(rowHeader));
+		if (this->dataLength - offset - rowHeaderSize < std::streamoff(buffer.size()) || !file.read(buffer.data(), buffer.size())
+			|| (this->checksummed && readUInt32(rowHeader + 4) != checksumOf(buffer)))
+			throw storage_damage_t(offset, "Storage row is damaged");
+		return true;
+	};
+
+	if (rows == nullptr) {
+		// Read the file from the beginning
+		file.seekg(firstOffset);
+		std::streamoff offset = firstOffset;
+		for (size_t row = 0; readRow(); ++row) {
+			if (isTombstoned(row))
+				buffer.clear();
+
+			func(offset, buffer);
+			offset = file.tellg();
+		}
+	}
+	else {
+		// Seek to every row (rows is sorted, so we only seek forward)
+		for (const size_t& row : *rows) {
+			if (row >= this->rowOffsets.size())
+				continue;
+
+			if (file.tellg() != this->rowOffsets[row]) {
+				// Neighboring rows are read without a seek (it would drop the read buffer)
+				file.clear();
+				file.seekg(this->rowOffsets[row]);
+			}
+			if (readRow())
+				func(this->rowOffsets[row], buffer);
 		}
 	}
-	
-	storageFile.close();
-	lockGuard.unlock();
 }
 
 size_t group_storage_t::countDocuments()
 {
-	return this->idPositions.size() + this->newDocuments.size();
+	// Removed ids always have a version below them, so the layers can be counted on their own
+	std::shared_lock<std::shared_mutex> lockGuard(this->stateLock);
+	return this->idPositions.size() - this->snapshot.removedDocuments.size() + this->snapshot.newDocuments.size()
+		- this->changes.removedDocuments.size() + this->changes.newDocuments.size();
 }
 
-void group_storage_t::insertDocument(const nlohmann::json& document)
+void group_storage_t::insertDocument(const nlohmann::json& document, uint64_t lsn)
 {
-	this->newDocuments[document["id"].get<size_t>()] = document;
+	// Writers only touch the changes, so they never wait for a running save
+	std::unique_lock<std::shared_mutex> lockGuard(this->stateLock);
+	const size_t id = document["id"].get<size_t>();
+	if (!this->changes.newDocuments.count(id) && !this->changes.removedDocuments.count(id) && this->existsBelow(id)) {
+		// Replaces the stored version
+		this->changes.removedDocuments.insert(id);
+		this->changes.editedDocuments.erase(id);
+		if (this->cache != nullptr)
+			this->cache->invalidate(id);
+	}
+
+	this->changes.newDocuments[id] = document;
+	this->pendingLsn = std::max(this->pendingLsn, lsn);
 }
 
-void group_storage_t::editDocument(const size_t id, const nlohmann::json& update)
+void group_storage_t::editDocument(const size_t id, const nlohmann::json& update, uint64_t lsn)
 {
-	if (!this->savedHere(id))
+	std::unique_lock<std::shared_mutex> lockGuard(this->stateLock);
+
+	const auto newDocument = this->changes.newDocuments.find(id);
+	if (newDocument != this->changes.newDocuments.end()) {
+		// Not written down yet ==> update it directly
+		nlohmann::json newDoc;
+		UPDATE::performUpdate(newDocument->second, update, newDoc);
+		newDocument->second = newDoc;
+	}
+	else if (!this->changes.removedDocuments.count(id) && this->existsBelow(id)) {
+		// Queue it behind the updates which are still waiting for this document
+		this->changes.editedDocuments[id].push_back(update);
+		if (this->cache != nullptr)
+			this->cache->invalidate(id);
+	}
+	else
 		return;
 
-	this->editedDocuments[this->idPositions[id]] = update;
+	this->pendingLsn = std::max(this->pendingLsn, lsn);
 }
 
-bool group_storage_t::removeDocument(const size_t id)
+bool group_storage_t::removeDocument(const size_t id, uint64_t lsn)
 {
-	if (this->idPositions.count(id)) {
-		this->removedDocuments.insert(this->idPositions[id]);
-		this->idPositions.erase(id);
-		return true;
+	std::unique_lock<std::shared_mutex> lockGuard(this->stateLock);
+
+	if (!this->changes.newDocuments.erase(id)) {
+		if (this->changes.removedDocuments.count(id) || !this->existsBelow(id))
+			return false;
+
+		this->changes.removedDocuments.insert(id);
+		this->changes.editedDocuments.erase(id); // updates of a removed document do not matter anymore
+		if (this->cache != nullptr)
+			this->cache->invalidate(id);
 	}
 
-	return false;	
+	this->pendingLsn = std::max(this->pendingLsn, lsn);
+	return true;
+}
+
+uint64_t group_storage_t::getPersistedLsn()
+{
+	std::shared_lock<std::shared_mutex> lockGuard(this->stateLock);
+	return this->persistedLsn;
+}
+
+uint64_t group_storage_t::getPendingLsn()
+{
+	std::shared_lock<std::shared_mutex> lockGuard(this->stateLock);
+	return this->pendingLsn;
+}
+
+void group_storage_t::setCompressionLevel(int compressionLevel)
+{
+	// Takes effect with the next rewrite of the storage file
+	std::unique_lock<std::mutex> writeGuard(this->writeLock);
+	std::unique_lock<std::shared_mutex> lockGuard(this->stateLock);
+	this->compressionLevel = compressionLevel;
+}
+
+bool group_storage_t::isOutdated()
+{
+	// True when the storage file is not written like a rewrite would write it (text, older versions
+	// without row checksums, another encoding or compression)
+	std::shared_lock<std::shared_mutex> lockGuard(this->stateLock);
+	return this->headerSize != STORAGE_HEADER_SIZE
+		|| !this->checksummed
+		|| this->storageFormat != storageFormatFromName(STORAGE_ENCODING)
+		|| this->compressed != (this->compressionLevel > 0);
+}
+
+float group_storage_t::getFragmentation()
+{
+	// Share of rows inside the storage file which are holes (empty or tombstoned)
+	std::shared_lock<std::shared_mutex> lockGuard(this->stateLock);
+	return this->rowOffsets.size() ? float(this->holeCount) / float(this->rowOffsets.size()) : 0.0f;
+}
+
+nlohmann::json group_storage_t::getStatistics()
+{
+	std::shared_lock<std::shared_mutex> lockGuard(this->stateLock);
+
+	return {
+		{"file", this->storagePath.filename().u8string()},
+		{"documents", this->idPositions.size() - this->snapshot.removedDocuments.size() + this->snapshot.newDocuments.size()
+			- this->changes.removedDocuments.size() + this->changes.newDocuments.size()},
+		{"rows", this->rowOffsets.size()},
+		{"holes", this->holeCount},
+		{"fragmentation", this->rowOffsets.size() ? float(this->holeCount) / float(this->rowOffsets.size()) : 0.0f},
+		{"bytes", this->dataLength},
+		{"compressed", this->compressed},
+		{"checksummed", this->checksummed},
+		{"uncompressedBytes", this->compressed ? this->uncompressedLength : this->dataLength - std::streamoff(this->headerSize)},
+		{"unsavedChanges", this->changes.size() + this->snapshot.size()}
+	};
+}
+
+std::streamoff group_storage_t::compact()
+{
+	// Rewrite the storage file without its holes (pending changes are written too).
+	// Returns the bytes which were written
+	std::unique_lock<std::mutex> writeGuard = this->lockWriter();
+	if (!this->holeCount && !this->isOutdated())
+		return 0; // Nothing to win
+
+	{
+		std::unique_lock<std::mutex> mutationGuard = this->lockMutations();
+		this->takeSnapshot();
+	}
+	this->rewriteStorageFile();
+	return this->dataLength;
+}
+
+void group_storage_t::removeFiles()
+{
+	// Delete the storage file (and its tombstones). Only for storages which are not used anymore
+	std::unique_lock<std::mutex> writeGuard(this->writeLock);
+	std::unique_lock<std::shared_mutex> fileGuard(this->fileLock);
+	std::unique_lock<std::shared_mutex> lockGuard(this->stateLock);
+	this->unmapStorageFile();
+	std::filesystem::remove(this->tombstonePath());
+	std::filesystem::remove(this->idSidecarPath());
+	std::filesystem::remove(this->storagePath);
+}
+
+std::filesystem::path group_storage_t::getPath()
+{
+	return this->storagePath;
 }
 
 std::vector<size_t> group_storage_t::getAllIds()
@@ -136,111 +1398,385 @@ std::vector<size_t> group_storage_t::getAllIds()
 
 void group_storage_t::getAllIds(std::vector<size_t>& container)
 {
-	for (const auto& item : this->idPositions)
-		container.push_back(item.first);
-	for (const auto& item : this->newDocuments)
+	std::shared_lock<std::shared_mutex> lockGuard(this->stateLock);
+	this->collectIds(container);
+}
+
+void group_storage_t::collectIds(std::vector<size_t>& container)
+{
+	// Ids of the newest versions (every id once). stateLock has to be held by the caller
+	container.reserve(container.size() + this->idPositions.size() + this->snapshot.newDocuments.size() + this->changes.newDocuments.size());
+	for (const auto& [id, row] : this->idPositions) {
+		if (!this->snapshot.removedDocuments.count(id) && !this->changes.removedDocuments.count(id))
+			container.push_back(id);
+	}
+	for (const auto& item : this->snapshot.newDocuments) {
+		if (!this->changes.removedDocuments.count(item.first))
+			container.push_back(item.first);
+	}
+	for (const auto& item : this->changes.newDocuments)
 		container.push_back(item.first);
 }
 
-void group_storage_t::doFuncOnAllDocuments(std::function<void(const nlohmann::json&)> func)
+void group_storage_t::doFuncOnAllDocuments(std::function<void(const nlohmann::json&)> func, bool ordered)
 {
-	this->save(); // write all unsaved/edited things down
-	std::unique_lock<std::mutex> lockGuard(this->fileLock, std::defer_lock);
-	lockGuard.lock();
+	// Write all unsaved/edited things down. Only the storage file is read, so it is pinned (writers go on)
+	this->save();
+	std::shared_lock<std::shared_mutex> fileGuard(this->fileLock);
 
-	// Perform func on every object
-	this->storageFile = std::fstream(this->storagePath);
-	std::string line;
-	while (std::getline(this->storageFile, line)) {
-		if (line == EMPTY_ROW_SEQUENCE)
-			continue;
-		
-		// Fire func on this document
-		const nlohmann::json lineDocument = nlohmann::json::parse(line);
-		func(lineDocument);
+	// Split the rows into chunks of about SCAN_CHUNK_SIZE bytes (compressed files only at block borders,
+	// so that every block gets decompressed once). Holes are left out
+	std::vector<std::vector<size_t>> chunks = { {} };
+	std::streamoff chunkBegin = this->rowOffsets.size() ? this->rowOffsets[0] : 0;
+	for (size_t row = 0; row < this->rowOffsets.size(); ++row) {
+		const std::streamoff offset = this->rowOffsets[row];
+		const bool chunkFull = offset - chunkBegin >= SCAN_CHUNK_SIZE
+			&& (!this->compressed || this->blockOf(offset) != this->blockOf(this->rowOffsets[row - 1]));
+
+		if (chunkFull && chunks.back().size()) {
+			chunks.push_back({});
+			chunkBegin = offset;
+		}
+		if (row >= this->tombstoned.size() || !this->tombstoned[row])
+			chunks.back().push_back(row);
 	}
 
-	lockGuard.unlock();
+	// Parses the rows of one chunk and hands every document to out
+	auto parseChunk = [this](const std::vector<size_t>& rows, const std::function<void(const nlohmann::json&)>& out) {
+		this->visitRows(&rows, [this, &out](std::streamoff, std::string_view row) {
+			if (row.size()) // Not an empty row
+				out(decodeDocument(this->storageFormat, row));
+		});
+	};
+
+	if (chunks.size() == 1) {
+		parseChunk(chunks[0], func); // Not worth the pool
+		return;
+	}
+
+	worker_pool_t& pool = getWorkerPool();
+	if (!ordered) {
+		// func runs on the pool threads (at the same time)
+		std::vector<std::future<void>> futures;
+		futures.reserve(chunks.size());
+		for (const auto& chunk : chunks)
+			futures.push_back(pool.push([&parseChunk, &chunk, &func]() { parseChunk(chunk, func); }));
+
+		pool.wait(futures);
+		return;
+	}
+
+	// Ordered: Chunks are parsed on the pool, but func runs on this thread in the order of the rows.
+	// Only a window of chunks is parsed ahead, so not the whole file ends up in memory
+	const size_t window = pool.size() * 2;
+	std::vector<std::vector<nlohmann::json>> parsed(chunks.size());
+	std::vector<std::future<void>> futures(chunks.size());
+	size_t pushed = 0;
+	try {
+		for (size_t i = 0; i < chunks.size(); ++i) {
+			for (; pushed < chunks.size() && pushed < i + window; ++pushed) {
+				futures[pushed] = pool.push([&parseChunk, &chunks, &parsed, pushed]() {
+					parseChunk(chunks[pushed], [&parsed, pushed](const nlohmann::json& document) { parsed[pushed].push_back(document); });
+				});
+			}
+
+			pool.wait(futures[i]);
+			for (const auto& document : parsed[i])
+				func(document);
+			std::vector<nlohmann::json>().swap(parsed[i]);
+		}
+	}
+	catch (...) {
+		// The chunks which are still running use parsed and chunks
+		for (size_t i = 0; i < pushed; ++i) {
+			if (futures[i].valid())
+				futures[i].wait();
+		}
+		throw;
+	}
 }
 
-void group_storage_t::save()
+std::unique_lock<std::mutex> group_storage_t::lockWriter(bool deferred)
+{
+	// Only one save (or compaction) at a time. Has to be taken before the mutationLock of the collection
+	if (deferred)
+		return std::unique_lock<std::mutex>(this->writeLock, std::defer_lock);
+	return std::unique_lock<std::mutex>(this->writeLock);
+}
+
+std::unique_lock<std::mutex> group_storage_t::lockMutations()
+{
+	// Snapshots which the storage takes itself wait for the collection, so that they never end inside a logged
+	// change of several documents (the replay skips records up to the lsn of the snapshot). writeLock comes first
+	if (this->mutationLock == nullptr)
+		return std::unique_lock<std::mutex>();
+	return std::unique_lock<std::mutex>(*this->mutationLock);
+}
+
+bool group_storage_t::takeSnapshot()
 {
-	// Open a new file in append mode and write everything inside
-	// Then set it as storagePath and delete old one
-	// The new Filename is the hashed (old) filename
+	// Freeze the changes so far (copy on write: writers go on with an empty change set, nothing gets copied).
+	// A snapshot which was not written down (failed save) takes the new changes on top. Returns false
+	// when there is nothing to write (a failed save always has to be repeated, see unsynced). writeLock (and the mutationLock of the collection) has to be held by the caller
+	std::unique_lock<std::shared_mutex> lockGuard(this->stateLock);
+	if (this->snapshot.empty())
+		std::swap(this->snapshot, this->changes);
+	else
+		this->snapshot.merge(this->changes);
+	this->changes.clear();
+	this->snapshot.lsn = this->pendingLsn;
+	return !this->snapshot.empty() || this->unsynced;
+}
 
-	if (!this->newDocuments.size() && !this->editedDocuments.size() && !this->removedDocuments.size())
+void group_storage_t::writeSnapshot()
+{
+	// Write the snapshot down. Either append it to the storage file (incremental save) or
+	// rewrite the whole file, when that is not possible or too many rows would be holes afterwards.
+	// The files are written while readers and writers go on, only taking over the new state blocks them
+	// writeLock has to be held by the caller
+	if (this->snapshot.empty() && !this->unsynced)
 		return; // Nothing was changed
-	std::unique_lock<std::mutex> lockGuard(this->fileLock, std::defer_lock);
-	lockGuard.lock();
-
-	// Create random (/hashed) new filename
-	std::string oldFilePath = this->storagePath.parent_path().u8string();
-	std::string oldFileName = this->storagePath.filename().u8string();
-	std::string newFilePath = oldFilePath + "//" + sha256(oldFileName) + ".knndb";
-	std::fstream newStorageFile = std::fstream(newFilePath, std::ios::app);
-
-	// Open also old file
-	this->storageFile = std::fstream(this->storagePath);
-	std::string line;
-	size_t lineIndex = 0;
-
-	// Write it all down
-	while (std::getline(this->storageFile, line)) {
-		if (line == EMPTY_ROW_SEQUENCE) {
-			// Is empty row ==> fill it with the first open one and set id to this position in idPositions 
-			if(this->newDocuments.size()) {
-				auto item = *(this->newDocuments.begin());
-				newStorageFile << item.second.dump() << "\n";
-
-				this->newDocuments.erase(item.first);
-				this->idPositions[item.first] = lineIndex;
-			}
-			else {
-				// Cannot find anything new ==> Use Empty Row Sequence
-				newStorageFile << EMPTY_ROW_SEQUENCE << "\n";
-			}
+
+	const size_t holesAfter = this->holeCount + this->snapshot.editedDocuments.size() + this->snapshot.removedDocuments.size();
+	const size_t rowsAfter = this->rowOffsets.size() + this->snapshot.editedDocuments.size() + this->snapshot.newDocuments.size();
+	const bool rewrite = !STORAGE_INCREMENTAL_SAVE
+		|| this->unsynced
+		|| this->isOutdated()
+		|| float(holesAfter) > MAX_STORAGE_FRAGMENTATION * float(rowsAfter);
+
+	if (rewrite)
+		this->rewriteStorageFile();
+	else
+		this->appendToStorageFile();
+}
+
+void group_storage_t::save()
+{
+	// Write all changes down
+	std::unique_lock<std::mutex> writeGuard = this->lockWriter();
+	{
+		std::unique_lock<std::mutex> mutationGuard = this->lockMutations();
+		this->takeSnapshot();
+	}
+	this->writeSnapshot();
+}
+
+void group_storage_t::rewriteStorageFile()
+{
+	// Write the storage file with the snapshot into a temporary file (always in the configured binary encoding and
+	// compression, so old files get migrated on their first rewrite). Holes are dropped,
+	// so the rows get renumbered. Then it replaces the storage file in one step
+	// writeLock has to be held by the caller (readers and writers go on until the new file is swapped in)
+	const std::filesystem::path newFilePath = this->temporaryPath();
+	this->unsynced = true;
+	std::fstream newStorageFile = std::fstream(newFilePath, std::ios::out | std::ios::trunc | std::ios::binary);
+	std::vector<std::streamoff> newRowOffsets = {};
+	newRowOffsets.reserve(this->idPositions.size() + this->snapshot.newDocuments.size());
+
+	// Write header (the committed length gets patched in at the end)
+	const StorageFormat newFormat = storageFormatFromName(STORAGE_ENCODING);
+	const uint64_t newGeneration = 0;
+	this->writeHeader(newStorageFile, newFormat, 0, newGeneration, this->compressionLevel > 0);
+	std::vector<std::pair<std::streamoff, std::streamoff>> newBlockIndex = {};
+	row_writer_t writer(newStorageFile, this->compressionLevel, STORAGE_HEADER_SIZE, 0, newBlockIndex);
+
+	// Every written row gets its offset recorded
+	auto writeRow = [&writer, &newRowOffsets](std::string_view payload) {
+		newRowOffsets.push_back(writer.write(payload));
+	};
+
+	// Which document lives in which row (removed ones are left out)
+	std::vector<size_t> rowIds(this->rowOffsets.size(), 0);
+	std::vector<bool> rowUsed(this->rowOffsets.size(), false);
+	for (const auto& [id, row] : this->idPositions) {
+		rowIds[row] = id;
+		rowUsed[row] = !this->snapshot.removedDocuments.count(id);
+	}
+
+	id_map_t newIdPositions;
+	newIdPositions.reserve(this->idPositions.size() + this->snapshot.newDocuments.size());
+	size_t rowIndex = 0;
+
+	// Write it all down (walk through the old file)
+	this->visitRows(nullptr, [this, &writeRow, &rowIndex, &rowIds, &rowUsed, &newIdPositions, &newRowOffsets, newFormat](std::streamoff, std::string_view row) {
+		const size_t id = rowIndex < rowIds.size() ? rowIds[rowIndex] : 0;
+		const bool used = rowIndex < rowUsed.size() && rowUsed[rowIndex];
+		++rowIndex;
+		if (!row.size() || !used)
+			return; // Hole or removed document
+
+		newIdPositions.set(id, newRowOffsets.size());
+		const auto edited = this->snapshot.editedDocuments.find(id);
+
+		if (edited != this->snapshot.editedDocuments.end()) {
+			nlohmann::json newDoc = decodeDocument(this->storageFormat, row);
+			performUpdates(newDoc, edited->second);
+			if (this->cache != nullptr)
+				this->cache->invalidate(id);
+
+			writeRow(encodeDocument(newFormat, newDoc));
+		}
+		else if (this->storageFormat == newFormat) {
+			// This document is not touched
+			writeRow(row);
 		}
 		else {
-			// Line contains an document
-			if (this->editedDocuments.count(lineIndex)) {
-				// Perform Update
-				nlohmann::json newDoc;
-				nlohmann::json oldDoc = nlohmann::json::parse(line);
-				UPDATE::performUpdate(oldDoc, this->editedDocuments[lineIndex], newDoc);
-
-				// Insert update
-				newStorageFile << newDoc.dump() << "\n";
-				this->editedDocuments.erase(lineIndex);
-			}
-			else if (this->removedDocuments.count(lineIndex)) {
-				// Delete Document
-				newStorageFile << EMPTY_ROW_SEQUENCE << "\n";
-				this->removedDocuments.erase(lineIndex);
-			}
-			else {
-				// This document is not touched
-				newStorageFile << line << "\n";
-			}
-		
+			// This document is not touched, but stored in another format ==> migrate it
+			writeRow(encodeDocument(newFormat, decodeDocument(this->storageFormat, row)));
 		}
-		++lineIndex;
-	}
+	});
 
-	// Add new Documents (if some still there)
-	for (const auto& item : this->newDocuments) {
-		newStorageFile << item.second.dump() << "\n";
-		this->idPositions[item.first] = lineIndex;
-		++lineIndex;
+	// Add new Documents
+	for (const auto& item : this->snapshot.newDocuments) {
+		newIdPositions.set(item.first, newRowOffsets.size());
+		writeRow(encodeDocument(newFormat, item.second));
 	}
-	this->newDocuments.clear();
 
+	// Everything is inside ==> commit it
+	const std::streamoff offset = writer.finish();
+	newStorageFile.seekp(16);
+	writeUInt64(newStorageFile, uint64_t(offset));
 	newStorageFile.close();
-	this->storageFile.close();
+	syncFile(newFilePath);
 
-	// Delete old file  and change storagePath
-	std::filesystem::remove(this->storagePath);
-	this->storagePath = newFilePath;
+	// Swap it in (the old mapping has to be released before, the new file gets mapped afterwards, a failed
+	// rename keeps the old one). Until they are removed, the old tombstones and id sidecar do not match the new file
+	// (their generation / fingerprint belongs to the old one)
+	std::unique_lock<std::shared_mutex> fileGuard(this->fileLock);
+	std::unique_lock<std::shared_mutex> lockGuard(this->stateLock);
+	this->unmapStorageFile();
+	try {
+		std::filesystem::rename(newFilePath, this->storagePath);
+	}
+	catch (const std::filesystem::filesystem_error&) {
+		this->mapStorageFile();
+		throw;
+	}
+	std::filesystem::remove(this->tombstonePath());
+	std::filesystem::remove(this->idSidecarPath());
 
+	this->storageFormat = newFormat;
+	this->headerSize = STORAGE_HEADER_SIZE;
+	this->dataLength = offset;
+	this->compressed = this->compressionLevel > 0;
+	this->checksummed = true;
+	this->blockIndex.swap(newBlockIndex);
+	this->uncompressedLength = writer.getRowsOffset();
+	this->generation = newGeneration;
+	this->persistedLsn = this->snapshot.lsn;
+	this->rowOffsets.swap(newRowOffsets);
+	this->idPositions.swap(newIdPositions);
+	this->tombstoned.assign(this->rowOffsets.size(), false);
+	this->holeCount = 0;
+	this->snapshot.clear();
+	this->mapStorageFile();
 	lockGuard.unlock();
+	fileGuard.unlock();
+
+	// The new file is only there for sure when the directory entry is on disk
+	syncFile(std::filesystem::absolute(this->storagePath).parent_path());
+	this->unsynced = false;
+
+	this->writeIdSidecar();
+}
+
+void group_storage_t::appendToStorageFile()
+{
+	// Append new documents of the snapshot and the new versions of edited ones behind the committed length
+	// and tombstone the replaced/removed rows. Nothing is valid before the header carries
+	// the new committed length and generation (the last write)
+	// writeLock has to be held by the caller (readers and writers go on until the new state is taken over)
+	this->unsynced = true;
+
+	// Perform Updates (in the order they came in) on the stored versions
+	std::vector<size_t> editedRows;
+	editedRows.reserve(this->snapshot.editedDocuments.size());
+	for (const auto& item : this->snapshot.editedDocuments)
+		editedRows.push_back(this->idPositions.at(item.first));
+	std::sort(editedRows.begin(), editedRows.end());
+
+	std::vector<std::pair<size_t, std::string>> appendRows; // 1. id of doc 2. encoded document
+	appendRows.reserve(editedRows.size() + this->snapshot.newDocuments.size());
+
+	this->visitRows(&editedRows, [this, &appendRows](std::streamoff, std::string_view row) {
+		nlohmann::json newDoc = decodeDocument(this->storageFormat, row);
+		const size_t id = newDoc["id"].get<size_t>();
+
+		performUpdates(newDoc, this->snapshot.editedDocuments.at(id));
+		if (this->cache != nullptr)
+			this->cache->invalidate(id);
+		appendRows.push_back({ id, encodeDocument(this->storageFormat, newDoc) });
+	});
+
+	for (const auto& item : this->snapshot.newDocuments)
+		appendRows.push_back({ item.first, encodeDocument(this->storageFormat, item.second) });
+
+	// Append the rows (compressed files get new blocks). What an unfinished save left behind the
+	// committed length is overwritten, readers never look behind it
+	std::fstream file(this->storagePath, std::ios::in | std::ios::out | std::ios::binary);
+	file.seekp(this->dataLength);
+	std::vector<std::pair<std::streamoff, std::streamoff>> newBlocks = {};
+	row_writer_t writer(file, this->compressed ? this->compressionLevel : 0, this->dataLength, this->uncompressedLength, newBlocks);
+	std::vector<std::streamoff> newRowOffsets = {};
+	newRowOffsets.reserve(appendRows.size());
+
+	for (const auto& item : appendRows)
+		newRowOffsets.push_back(writer.write(item.second));
+	const std::streamoff offset = writer.finish();
+	file.flush();
+
+	// Tombstone the old versions of the edited documents and the removed ones
+	const uint64_t newGeneration = this->generation + 1;
+	std::vector<size_t> deadRows = editedRows;
+	for (const size_t& id : this->snapshot.removedDocuments)
+		deadRows.push_back(this->idPositions.at(id));
+
+	if (deadRows.size()) {
+		const bool newTombstones = !std::filesystem::exists(this->tombstonePath());
+		std::ofstream tombstones(this->tombstonePath(), std::ios::out | std::ios::app | std::ios::binary);
+		writeUInt64(tombstones, newGeneration);
+		writeUInt32(tombstones, uint32_t(deadRows.size()));
+		for (const size_t& row : deadRows)
+			writeUInt64(tombstones, row);
+		tombstones.close();
+
+		syncFile(this->tombstonePath());
+		if (newTombstones)
+			syncFile(std::filesystem::absolute(this->storagePath).parent_path());
+	}
+
+	// Commit: lsn, committed length and generation (the rows have to be on disk before the header points at them)
+	syncFile(this->storagePath);
+	file.seekp(8);
+	writeUInt64(file, this->snapshot.lsn);
+	writeUInt64(file, uint64_t(offset));
+	writeUInt64(file, newGeneration);
+	file.close();
+	syncFile(this->storagePath);
+
+	// Take it over in memory
+	std::unique_lock<std::shared_mutex> fileGuard(this->fileLock);
+	std::unique_lock<std::shared_mutex> lockGuard(this->stateLock);
+	this->unmapStorageFile();
+	for (const size_t& row : deadRows)
+		this->markHole(row);
+	for (const size_t& id : this->snapshot.removedDocuments)
+		this->idPositions.erase(id); // inserted again ==> its new row gets set below
+	for (size_t i = 0; i < appendRows.size(); ++i)
+		this->idPositions.set(appendRows[i].first, this->rowOffsets.size() + i);
+	this->rowOffsets.insert(this->rowOffsets.end(), newRowOffsets.begin(), newRowOffsets.end());
+	this->tombstoned.resize(this->rowOffsets.size());
+
+	this->dataLength = offset;
+	this->blockIndex.insert(this->blockIndex.end(), newBlocks.begin(), newBlocks.end());
+	this->uncompressedLength = writer.getRowsOffset();
+	this->generation = newGeneration;
+	this->persistedLsn = this->snapshot.lsn;
+	this->snapshot.clear();
+	this->mapStorageFile();
+	lockGuard.unlock();
+	fileGuard.unlock();
+	this->unsynced = false;
+
+	this->writeIdSidecar();
 }
@@ -5,37 +5,152 @@
 #include <fstream>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <set>
+#include <vector>
 #include <random>
 #include <chrono>
 #include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <functional>
 
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include <nlohmann/json.hpp>
 
-nlohmann::json reduceJsonObject(nlohmann::json&, std::map<std::string, bool>&);
+#include "cache.h"
+#include "idmap.h"
+
+enum class StorageFormat : uint8_t {
+	Text = 0, // one JSON document per line (files written before the binary format)
+	MsgPack = 1,
+	Cbor = 2
+};
+
+inline uint32_t readUInt32(const char* data) {
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+	return uint32_t(bytes[0]) | (uint32_t(bytes[1]) << 8) | (uint32_t(bytes[2]) << 16) | (uint32_t(bytes[3]) << 24);
+}
+
+inline uint64_t readUInt64(const char* data) {
+	return uint64_t(readUInt32(data)) | (uint64_t(readUInt32(data + 4)) << 32);
+}
+
+inline void writeUInt32(std::ostream& stream, uint32_t value) {
+	const char bytes[4] = { char(value & 0xFF), char((value >> 8) & 0xFF), char((value >> 16) & 0xFF), char((value >> 24) & 0xFF) };
+	stream.write(bytes, 4);
+}
+
+inline void writeUInt64(std::ostream& stream, uint64_t value) {
+	writeUInt32(stream, uint32_t(value & 0xFFFFFFFF));
+	writeUInt32(stream, uint32_t(value >> 32));
+}
+
+uint32_t checksumOf(std::string_view data);
+void syncFile(const std::filesystem::path& path);
+void replaceFile(const std::filesystem::path& from, const std::filesystem::path& to);
+
+nlohmann::json reduceJsonObject(const nlohmann::json&, std::map<std::string, bool>&);
+StorageFormat storageFormatFromName(const std::string& name);
+nlohmann::json decodeDocument(StorageFormat format, std::string_view data);
+nlohmann::json decodeProjectedDocument(StorageFormat format, std::string_view data, std::map<std::string, bool>& projection); // only id and the visible top level fields get parsed
+std::string encodeDocument(StorageFormat format, const nlohmann::json& document);
+
+// Changes of documents which are not inside the storage file yet. Layers on top of the version below
+// (the storage file or an older change set)
+struct change_set_t {
+	std::unordered_map<size_t, nlohmann::json> newDocuments; // 1. id of doc 2. full document (a version below is inside removedDocuments then)
+	std::unordered_map<size_t, std::vector<nlohmann::json>> editedDocuments; // 1. id of doc 2. update operations (in order) on the version below
+	std::unordered_set<size_t> removedDocuments; // id of doc (its version below does not count anymore)
+	uint64_t lsn = 0; // last write-ahead log sequence number inside (set when it gets frozen)
+
+	bool empty() const { return !this->newDocuments.size() && !this->editedDocuments.size() && !this->removedDocuments.size(); }
+	size_t size() const { return this->newDocuments.size() + this->editedDocuments.size() + this->removedDocuments.size(); }
+	void merge(change_set_t& newer);
+	void clear();
+};
 
 class group_storage_t {
 private:
 	std::filesystem::path storagePath;
-	std::fstream storageFile;
-	std::mutex fileLock;
-	std::unordered_map<size_t, size_t> idPositions; // 1. id of doc 2. row index
-	std::unordered_map<size_t, nlohmann::json> newDocuments; // 1. id of doc 2. full document
-	std::unordered_map<size_t, nlohmann::json> editedDocuments; // 1. row index 2. update operation
-	std::set<size_t> removedDocuments; // row index
+	StorageFormat storageFormat = StorageFormat::Text;
+	boost::interprocess::file_mapping storageMapping; // only used when STORAGE_MEMORY_MAPPED is set
+	boost::interprocess::mapped_region storageRegion;
+	std::mutex writeLock; // serializes everything which writes the storage file (saves, compaction)
+	std::shared_mutex stateLock; // shared by readers, exclusive while the in-memory state (or the file) gets swapped
+	std::shared_mutex fileLock; // shared by scans of the storage file, exclusive while a save swaps it (comes before stateLock)
+	id_map_t idPositions; // 1. id of doc 2. row index
+	std::vector<std::streamoff> rowOffsets; // byte offset of every row inside the storage file (index = row index)
+	change_set_t changes; // changes since the last snapshot (the only thing writers touch)
+	change_set_t snapshot; // frozen changes which are written down right now (on top of the storage file, below changes)
+	uint64_t persistedLsn = 0; // last write-ahead log sequence number (or collection generation) which is inside the storage file
+	uint64_t pendingLsn = 0; // last write-ahead log sequence number which got applied in memory
+	size_t headerSize = 0; // bytes in front of the first row (0 for the text format)
+	std::streamoff dataLength = 0; // committed bytes of the storage file (rows behind it belong to an unfinished save)
+	uint64_t generation = 0; // number of incremental saves since the last full rewrite
+	bool unsynced = false; // a save failed on the way, so written parts of the storage file may be lost (the next save rewrites it, writeLock)
+	std::vector<bool> tombstoned; // rows which got replaced or removed by an incremental save (index = row index)
+	size_t holeCount = 0; // empty or tombstoned rows inside the storage file
+	document_cache_t* cache = nullptr; // parsed documents of the collection (optional)
+	std::mutex* mutationLock = nullptr; // mutationLock of the collection (optional), taken by snapshots of the storage itself
+	int compressionLevel = 0; // zlib level of rewritten storage files (0 = uncompressed)
+	bool compressed = false; // rows are stored in compressed blocks (rowOffsets are offsets inside the uncompressed rows then)
+	bool checksummed = false; // every row carries a crc32 of its payload (format version 4)
+	std::vector<std::pair<std::streamoff, std::streamoff>> blockIndex; // compressed files: 1. offset of the first row (uncompressed) 2. file offset of the block
+	std::streamoff uncompressedLength = 0; // compressed files: bytes of all rows after decompression
+
+	void mapStorageFile();
+	void unmapStorageFile();
+	void readHeader();
+	void writeHeader(std::ostream& stream, StorageFormat format, std::streamoff dataLength, uint64_t generation, bool compressed = false);
+	void loadBlockIndex();
+	size_t blockOf(std::streamoff rowOffset);
+	void readBlock(std::istream& file, size_t block, std::string& buffer);
+	void loadRows();
+	void salvage(std::streamoff validLength, const std::string& reason);
+	std::filesystem::path temporaryPath();
+	std::filesystem::path tombstonePath();
+	void loadTombstones();
+	void markHole(size_t row);
+	std::filesystem::path idSidecarPath();
+	uint32_t dataFingerprint();
+	bool loadIdSidecar();
+	void writeIdSidecar();
+	bool existsBelow(size_t id);
+	void collectIds(std::vector<size_t>& container);
+	void rewriteStorageFile();
+	void appendToStorageFile();
+	void visitRows(const std::vector<size_t>* rows, const std::function<void(std::streamoff, std::string_view)>& func);
+	std::unique_lock<std::mutex> lockMutations();
 
 public:
-	group_storage_t(std::string storagePath);
+	group_storage_t(std::string storagePath, document_cache_t* cache = nullptr, int compressionLevel = 0, std::mutex* mutationLock = nullptr);
 	bool savedHere(size_t);
 	void getDocuments(std::vector<size_t>* ids, std::vector<nlohmann::json>& documents, bool allDocuments = false, std::map<std::string, bool> projection = {});
 	
 	size_t countDocuments();
-	void insertDocument(const nlohmann::json& document);
-	void editDocument(const size_t id, const nlohmann::json& update);
-	bool removeDocument(const size_t id);
+	void insertDocument(const nlohmann::json& document, uint64_t lsn = 0);
+	void editDocument(const size_t id, const nlohmann::json& update, uint64_t lsn = 0);
+	bool removeDocument(const size_t id, uint64_t lsn = 0);
+	uint64_t getPersistedLsn();
+	uint64_t getPendingLsn();
+
+	void setCompressionLevel(int compressionLevel);
+	bool isOutdated();
+	float getFragmentation();
+	nlohmann::json getStatistics();
+	std::streamoff compact();
+	void removeFiles();
 
+	std::filesystem::path getPath();
 	std::vector<size_t> getAllIds();
 	void getAllIds(std::vector<size_t>& container);
-	void doFuncOnAllDocuments(std::function<void(const nlohmann::json&)> func);
+	void doFuncOnAllDocuments(std::function<void(const nlohmann::json&)> func, bool ordered = false); // parsed in chunks on the worker pool: func has to be thread safe unless ordered (then it runs on the calling thread in row order)
+	std::unique_lock<std::mutex> lockWriter(bool deferred = false);
+	bool takeSnapshot();
+	void writeSnapshot();
 	void save();
 };
 
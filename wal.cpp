@@ -0,0 +1,280 @@
+#include <string>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "storage.h"
+#include "wal.h"
+
+// Log file layout: every record is	payload length (u32, little endian) | payload (MessagePack)
+// The payload is an object with the sequence number ("lsn") and the operation ("op")
+
+inline int fsyncFile(std::FILE* file) {
+#ifdef _WIN32
+	return _commit(_fileno(file));
+#else
+	return fsync(fileno(file));
+#endif
+}
+
+write_ahead_log_t::write_ahead_log_t(std::filesystem::path logPath)
+{
+	this->logPath = logPath;
+	this->committer = std::thread(&write_ahead_log_t::runCommitter, this);
+}
+
+write_ahead_log_t::~write_ahead_log_t()
+{
+	std::unique_lock<std::mutex> lockGuard(this->bufferLock);
+	this->stopCommitter = true;
+	this->bufferChanged.notify_all();
+	lockGuard.unlock();
+
+	if (this->committer.joinable())
+		this->committer.join();
+	if (this->logFile != nullptr)
+		std::fclose(this->logFile);
+}
+
+std::filesystem::path write_ahead_log_t::tailPath()
+{
+	return std::filesystem::path(this->logPath).replace_extension(".tmp");
+}
+
+void write_ahead_log_t::replay(const std::function<void(uint64_t, const nlohmann::json&)>& func, uint64_t minLsn)
+{
+	// Has to be called once before the first append: Fires func on every record (in order) and
+	// cuts a torn tail (crash while writing) off. New records get numbers above minLsn
+	std::unique_lock<std::mutex> lockGuard(this->bufferLock);
+	this->lastLsn = minLsn;
+	std::filesystem::remove(this->tailPath()); // left by a checkpoint which never finished
+
+	std::ifstream input(this->logPath, std::ios::in | std::ios::binary);
+	std::streamoff validSize = 0;
+	std::string payload;
+	char lengthBytes[4];
+
+	while (input.read(lengthBytes, 4)) {
+		payload.resize(readUInt32(lengthBytes));
+		if (!input.read(payload.data(), payload.size()))
+			break; // Torn record
+
+		nlohmann::json record;
+		uint64_t lsn = 0;
+		try {
+			record = decodeDocument(StorageFormat::MsgPack, payload);
+			lsn = record.at("lsn").get<uint64_t>();
+		}
+		catch (const std::exception& ex) {
+			break; // Garbage at the end
+		}
+
+		func(lsn, record);
+		this->lastLsn = std::max(this->lastLsn, lsn);
+		validSize += 4 + payload.size();
+		this->recordEnds.push_back({ lsn, uint64_t(validSize) });
+	}
+	input.close();
+
+	if (std::filesystem::exists(this->logPath) && std::filesystem::file_size(this->logPath) != uintmax_t(validSize)) {
+		std::cout << "[WAL] Cut off a torn record at the end of " << this->logPath.u8string() << std::endl;
+		std::filesystem::resize_file(this->logPath, validSize);
+	}
+
+	this->writtenLsn = this->durableLsn = this->lastLsn;
+	this->logSize = uint64_t(validSize);
+	this->logFile = std::fopen(this->logPath.u8string().c_str(), "ab");
+	if (this->logFile == nullptr)
+		throw std::runtime_error("Cannot open write-ahead log: " + this->logPath.u8string());
+}
+
+uint64_t write_ahead_log_t::append(nlohmann::json record)
+{
+	// Number the record and hand it over to the committer. Returns the sequence
+	// number to wait for. A failed log refuses the record, so the caller changes nothing
+	std::unique_lock<std::mutex> lockGuard(this->bufferLock);
+	if (this->failure.size())
+		throw std::runtime_error("Write-ahead log failed: " + this->failure);
+	record["lsn"] = ++this->lastLsn;
+
+	std::ostringstream encoded;
+	const std::string payload = encodeDocument(StorageFormat::MsgPack, record);
+	writeUInt32(encoded, uint32_t(payload.size()));
+	encoded << payload;
+	this->buffer += encoded.str();
+	this->logSize += 4 + payload.size();
+	this->recordEnds.push_back({ this->lastLsn, this->logSize });
+
+	this->bufferChanged.notify_one();
+	return this->lastLsn;
+}
+
+void write_ahead_log_t::waitLsn(std::unique_lock<std::mutex>& lockGuard, const uint64_t& reachedLsn, uint64_t lsn)
+{
+	// Wait until reachedLsn (writtenLsn or durableLsn) passes lsn. Throws when the committer failed before
+	this->commitDone.wait(lockGuard, [this, &reachedLsn, lsn]() { return reachedLsn >= lsn || this->failure.size(); });
+	if (reachedLsn < lsn)
+		throw std::runtime_error("Write-ahead log failed: " + this->failure);
+}
+
+void write_ahead_log_t::waitWritten(uint64_t lsn)
+{
+	// Survives a crash of the process, but not of the machine
+	std::unique_lock<std::mutex> lockGuard(this->bufferLock);
+	this->waitLsn(lockGuard, this->writtenLsn, lsn);
+}
+
+void write_ahead_log_t::waitDurable(uint64_t lsn)
+{
+	std::unique_lock<std::mutex> lockGuard(this->bufferLock);
+	this->waitLsn(lockGuard, this->durableLsn, lsn);
+}
+
+uint64_t write_ahead_log_t::getLastLsn()
+{
+	std::unique_lock<std::mutex> lockGuard(this->bufferLock);
+	return this->lastLsn;
+}
+
+void write_ahead_log_t::truncate(uint64_t upToLsn)
+{
+	// Called by checkpoints after every storage saved the records up to upToLsn: Wait until the committer
+	// wrote everything and cut these records off (the numbering continues). Records which came in
+	// during the save are copied into a new log, which replaces the old one
+	std::unique_lock<std::mutex> lockGuard(this->bufferLock);
+	this->commitDone.wait(lockGuard, [this]() { return this->durableLsn >= this->lastLsn || this->failure.size(); });
+	if (this->failure.size()) {
+		if (upToLsn < this->lastLsn)
+			throw std::runtime_error("Write-ahead log failed: " + this->failure);
+		this->recover();
+		return;
+	}
+
+	uint64_t cutSize = 0;
+	size_t cutRecords = 0;
+	for (; cutRecords < this->recordEnds.size() && this->recordEnds[cutRecords].first <= upToLsn; ++cutRecords)
+		cutSize = this->recordEnds[cutRecords].second;
+	if (!cutSize)
+		return; // Nothing to cut off
+
+	std::string tail(this->logSize - cutSize, '\0');
+	if (tail.size()) {
+		std::ifstream input(this->logPath, std::ios::in | std::ios::binary);
+		input.seekg(std::streamoff(cutSize));
+		input.read(tail.data(), tail.size());
+		if (!input)
+			throw std::runtime_error("Cannot read write-ahead log: " + this->logPath.u8string());
+	}
+
+	// Once the old file is closed, a failed swap leaves the end of the log unknown (see failCommit)
+	std::fclose(this->logFile);
+	this->logFile = nullptr;
+	try {
+		if (tail.size()) {
+			const std::filesystem::path tailPath = this->tailPath();
+			std::ofstream output(tailPath, std::ios::out | std::ios::trunc | std::ios::binary);
+			output.write(tail.data(), tail.size());
+			output.close();
+			replaceFile(tailPath, this->logPath);
+			this->logFile = std::fopen(this->logPath.u8string().c_str(), "ab");
+		}
+		else
+			this->logFile = std::fopen(this->logPath.u8string().c_str(), "wb");
+		if (this->logFile == nullptr)
+			throw std::runtime_error("Cannot open write-ahead log: " + this->logPath.u8string());
+		if (fsyncFile(this->logFile) != 0)
+			throw std::runtime_error("Cannot fsync write-ahead log: " + this->logPath.u8string());
+	}
+	catch (const std::exception& ex) {
+		this->failCommit(ex.what());
+		throw;
+	}
+
+	this->recordEnds.erase(this->recordEnds.begin(), this->recordEnds.begin() + cutRecords);
+	this->logSize -= cutSize;
+	for (auto& recordEnd : this->recordEnds)
+		recordEnd.second -= cutSize;
+}
+
+void write_ahead_log_t::recover()
+{
+	// A checkpoint saved every record of the failed log (no new ones come in after the failure), so it
+	// starts again empty. bufferLock has to be held by the caller. Stays failed when the new log cannot be made
+	if (this->logFile != nullptr)
+		std::fclose(this->logFile);
+	this->logFile = std::fopen(this->logPath.u8string().c_str(), "wb");
+	if (this->logFile == nullptr)
+		throw std::runtime_error("Cannot open write-ahead log: " + this->logPath.u8string());
+	if (fsyncFile(this->logFile) != 0)
+		throw std::runtime_error("Cannot fsync write-ahead log: " + this->logPath.u8string());
+
+	this->failure.clear();
+	this->buffer.clear();
+	this->recordEnds.clear();
+	this->logSize = 0;
+	this->writtenLsn = this->durableLsn = this->lastLsn;
+	std::cout << "[WAL] Recovered, the changes are logged again: " << this->logPath.u8string() << std::endl;
+}
+
+void write_ahead_log_t::runCommitter()
+{
+	std::unique_lock<std::mutex> lockGuard(this->bufferLock);
+
+	while (true) {
+		this->bufferChanged.wait(lockGuard, [this]() { return this->buffer.size() || this->stopCommitter; });
+		if (this->failure.size())
+			this->buffer.clear(); // Nothing gets written behind a failed batch (the waiters got the error)
+		if (!this->buffer.size()) {
+			if (this->stopCommitter)
+				return; // Stopped and everything is written
+			continue;
+		}
+
+		// Take everything which is waiting: all these records share one fsync
+		std::string batch;
+		batch.swap(this->buffer);
+		const uint64_t batchLsn = this->lastLsn;
+		lockGuard.unlock();
+
+		const bool written = std::fwrite(batch.data(), 1, batch.size(), this->logFile) == batch.size()
+			&& std::fflush(this->logFile) == 0;
+
+		lockGuard.lock();
+		if (!written) {
+			this->failCommit("cannot write " + this->logPath.u8string());
+			continue;
+		}
+		this->writtenLsn = batchLsn;
+		this->commitDone.notify_all();
+		lockGuard.unlock();
+
+		const bool synced = fsyncFile(this->logFile) == 0;
+
+		lockGuard.lock();
+		if (!synced) {
+			this->failCommit("cannot fsync " + this->logPath.u8string());
+			continue;
+		}
+		this->durableLsn = batchLsn;
+		this->commitDone.notify_all();
+	}
+}
+
+void write_ahead_log_t::failCommit(const std::string& reason)
+{
+	// The end of the log file is unknown now (maybe a part of the batch is inside), so nothing gets written
+	// behind it anymore: every waiting and following writer gets the error. bufferLock has to be held by the caller
+	if (this->failure.empty())
+		std::cout << "[WAL] Failed, the following changes are not logged anymore: " << reason << std::endl;
+	this->failure = reason;
+	this->buffer.clear();
+	this->commitDone.notify_all();
+}
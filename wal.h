@@ -0,0 +1,57 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <string>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdio>
+#include <deque>
+
+#include <nlohmann/json.hpp>
+
+// Append-only log of all mutations of one collection. Records get a
+// sequence number (lsn) and are written by one committer thread: every record
+// which comes in while the committer is busy gets written with the next
+// fsync (group commit). Checkpoints cut the records off which the storages
+// saved (the ones which came in during the save stay). A failed log refuses
+// new records until a checkpoint saved everything it had
+class write_ahead_log_t {
+private:
+	std::filesystem::path logPath;
+	std::FILE* logFile = nullptr;
+
+	std::mutex bufferLock;
+	std::condition_variable bufferChanged; // committer waits for new records
+	std::condition_variable commitDone; // writers wait until their record is written / durable
+	std::string buffer; // encoded records which are not written yet
+	uint64_t lastLsn = 0; // sequence number of the last appended record
+	uint64_t writtenLsn = 0; // every record up to this sequence number is handed over to the OS
+	uint64_t durableLsn = 0; // every record up to this sequence number is fsynced
+	uint64_t logSize = 0; // bytes of all records (written or still inside buffer)
+	std::deque<std::pair<uint64_t, uint64_t>> recordEnds; // 1. sequence number 2. log size behind the record (in order)
+	std::string failure; // why the committer could not write (records behind writtenLsn / durableLsn never will be)
+	bool stopCommitter = false;
+	std::thread committer;
+
+	void runCommitter();
+	void failCommit(const std::string& reason);
+	void recover();
+	void waitLsn(std::unique_lock<std::mutex>& lockGuard, const uint64_t& reachedLsn, uint64_t lsn);
+	std::filesystem::path tailPath();
+
+public:
+	write_ahead_log_t(std::filesystem::path logPath);
+	~write_ahead_log_t();
+
+	void replay(const std::function<void(uint64_t, const nlohmann::json&)>& func, uint64_t minLsn = 0);
+	uint64_t append(nlohmann::json record);
+	void waitWritten(uint64_t lsn);
+	void waitDurable(uint64_t lsn);
+	uint64_t getLastLsn();
+	void truncate(uint64_t upToLsn);
+};
+
+#endif // !WAL_H
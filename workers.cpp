@@ -0,0 +1,109 @@
+#include <algorithm>
+
+#include "main.h"
+#include "workers.h"
+
+worker_pool_t::worker_pool_t(size_t threadCount)
+{
+	for (size_t i = 0; i < std::max<size_t>(threadCount, 1); ++i) {
+		this->threads.push_back(std::thread([this]() {
+			while (true) {
+				std::function<void()> task;
+				{
+					std::unique_lock<std::mutex> lockGuard(this->queueLock);
+					this->queueSignal.wait(lockGuard, [this]() { return this->stopping || this->tasks.size(); });
+					if (!this->tasks.size())
+						return; // Stopping and nothing left
+					task = std::move(this->tasks.front().second);
+					this->tasks.pop_front();
+				}
+				task();
+			}
+		}));
+	}
+}
+
+worker_pool_t::~worker_pool_t()
+{
+	{
+		std::unique_lock<std::mutex> lockGuard(this->queueLock);
+		this->stopping = true;
+	}
+	this->queueSignal.notify_all();
+
+	for (auto& thread : this->threads)
+		thread.join();
+}
+
+std::future<void> worker_pool_t::push(std::function<void()> task)
+{
+	// Exceptions of the task come out of the future
+	auto packagedTask = std::make_shared<std::packaged_task<void()>>(std::move(task));
+	std::future<void> future = packagedTask->get_future();
+	{
+		std::unique_lock<std::mutex> lockGuard(this->queueLock);
+		this->tasks.push_back({ std::this_thread::get_id(), [packagedTask]() { (*packagedTask)(); } });
+	}
+	this->queueSignal.notify_one();
+
+	return future;
+}
+
+bool worker_pool_t::runQueuedTask()
+{
+	// Runs the oldest queued task which the calling thread pushed itself. Returns false when none is queued
+	std::function<void()> task;
+	{
+		std::unique_lock<std::mutex> lockGuard(this->queueLock);
+		const std::thread::id caller = std::this_thread::get_id();
+		auto ownTask = std::find_if(this->tasks.begin(), this->tasks.end(), [&caller](const auto& item) { return item.first == caller; });
+		if (ownTask == this->tasks.end())
+			return false;
+		task = std::move(ownTask->second);
+		this->tasks.erase(ownTask);
+	}
+
+	task();
+	return true;
+}
+
+void worker_pool_t::wait(std::future<void>& future)
+{
+	// Help instead of blocking (the task we are waiting for may still be queued behind others). Only own tasks are
+	// run: the caller may hold locks (e.g. the fileLock of a scanned storage) which the tasks of others need
+	while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+		if (!this->runQueuedTask())
+			future.wait_for(std::chrono::milliseconds(1));
+	}
+
+	future.get(); // throws what the task has thrown
+}
+
+void worker_pool_t::wait(std::vector<std::future<void>>& futures)
+{
+	// Waits for all of them (they may use things of the caller), then throws the first exception
+	std::exception_ptr exception = nullptr;
+	for (auto& future : futures) {
+		try {
+			this->wait(future);
+		}
+		catch (...) {
+			if (exception == nullptr)
+				exception = std::current_exception();
+		}
+	}
+
+	if (exception != nullptr)
+		std::rethrow_exception(exception);
+}
+
+size_t worker_pool_t::size()
+{
+	return this->threads.size();
+}
+
+worker_pool_t& getWorkerPool()
+{
+	static worker_pool_t workerPool(WORKER_THREADS ? WORKER_THREADS : std::thread::hardware_concurrency());
+	return workerPool;
+}
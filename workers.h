@@ -0,0 +1,37 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+
+// Fixed number of threads which run short tasks of all collections (e.g. the chunks of a storage scan).
+// Threads which wait for their tasks run the queued ones they pushed themselves in the meantime, so tasks may
+// wait for other tasks. Tasks of others are left alone (they may need locks which the waiting thread holds)
+class worker_pool_t {
+private:
+	std::mutex queueLock;
+	std::condition_variable queueSignal;
+	std::deque<std::pair<std::thread::id, std::function<void()>>> tasks; // 1. thread which pushed it 2. task
+	std::vector<std::thread> threads;
+	bool stopping = false;
+
+	bool runQueuedTask();
+
+public:
+	worker_pool_t(size_t threadCount);
+	~worker_pool_t();
+
+	std::future<void> push(std::function<void()> task);
+	void wait(std::future<void>& future);
+	void wait(std::vector<std::future<void>>& futures);
+	size_t size();
+};
+
+worker_pool_t& getWorkerPool(); // shared by everything (WORKER_THREADS threads, created on first use)
+
+#endif // !WORKERS_H